@@ -1,3 +1,6 @@
+#ifndef DELAYALLPASS_H_INCLUDED
+#define DELAYALLPASS_H_INCLUDED
+
 #include <stdlib.h>
 #include <math.h>
 
@@ -8,6 +11,7 @@ typedef struct {
     int write_pos;
 
     float frac_delay;
+    float coeff;
 
     float prev_input;
     float prev_output;
@@ -17,16 +21,26 @@ int delayallpass_init(DelayAllpass *delay, int max_delay) {
     delay->read_pos = 0;
     delay->write_pos = 0;
     delay->max_delay = max_delay;
-    delay->buffer = (float*) malloc(sizeof(float) * max_delay );
+    delay->buffer = (float*) calloc(max_delay, sizeof(float) );
 
     delay->prev_input = 0;
     delay->prev_output = 0;
 
     delay->frac_delay = 0;
+    delay->coeff = 1;
 
     return delay->buffer != NULL;
 }
 
+// silences the line without touching its buffer's allocation or its delay
+void delayallpass_reset(DelayAllpass *delay) {
+    for (int i = 0; i < delay->max_delay; i++)
+        delay->buffer[i] = 0.f;
+
+    delay->prev_input = 0;
+    delay->prev_output = 0;
+}
+
 void delayallpass_set(DelayAllpass *delay, float len) {
     int int_delay = (int) floorf(len);
     delay->read_pos = delay->write_pos - int_delay;
@@ -34,14 +48,13 @@ void delayallpass_set(DelayAllpass *delay, float len) {
         delay->read_pos += delay->max_delay;
 
     delay->frac_delay = len - floorf(len);
+    delay->coeff = (1 - delay->frac_delay) / (1 + delay->frac_delay);
 }
 
 float delayallpass_read(DelayAllpass *delay) {
     float val = delay->buffer[delay->read_pos++];
 
-    float coeff = (1 - delay->frac_delay) / (1 + delay->frac_delay);
-
-    float output = coeff * val + delay->prev_input - coeff * delay->prev_output;
+    float output = delay->coeff * val + delay->prev_input - delay->coeff * delay->prev_output;
     delay->prev_input = val;
     delay->prev_output = output;
 
@@ -61,3 +74,5 @@ void delayallpass_write(DelayAllpass *delay, float input) {
 void delayallpass_free(DelayAllpass *delay) {
     free(delay->buffer);
 }
+
+#endif // DELAYALLPASS_H_INCLUDED
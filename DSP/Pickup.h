@@ -24,9 +24,25 @@ typedef struct {
 
 int pickup_init(Pickup *pickup, unsigned long sample_rate) {
     pickup->sample_rate = sample_rate;
+    pickup->position = 0.f;
+
+    for (int i = 0; i < 2; i++) {
+        pickup->inputs[i] = 0.f;
+        pickup->outputs[i] = 0.f;
+    }
+
     return delayallpass_init(&pickup->delay, sample_rate);
 }
 
+void pickup_reset(Pickup *pickup) {
+    for (int i = 0; i < 2; i++) {
+        pickup->inputs[i] = 0.f;
+        pickup->outputs[i] = 0.f;
+    }
+
+    delayallpass_reset(&pickup->delay);
+}
+
 void pickup_free(Pickup *pickup) {
     delayallpass_free(&pickup->delay);
 }
@@ -97,6 +113,12 @@ void pickup_setpickup(Pickup *pickup, float frequency, float Q, int preset, floa
 
             break;
     }
+
+    // normalised so the filter runs without dividing by A[0]
+    for (int i = 2; i >= 0; i--) {
+        pickup->B[i] /= pickup->A[0];
+        pickup->A[i] /= pickup->A[0];
+    }
 }
 
 float pickup_process(Pickup *pickup, float sample) {
@@ -105,7 +127,6 @@ float pickup_process(Pickup *pickup, float sample) {
 
     float filtered = delayed * pickup->B[0] + pickup->inputs[0] * pickup->B[1] + pickup->inputs[1] * pickup->B[2];
     filtered -= pickup->outputs[0] * pickup->A[1] + pickup->outputs[1] * pickup->A[2];
-    filtered *= 1.f / pickup->A[0];
 
     pickup->inputs[1] = pickup->inputs[0];
     pickup->inputs[0] = delayed;
@@ -1,7 +1,30 @@
+#ifndef PLUCKEDSTRING_H_INCLUDED
+#define PLUCKEDSTRING_H_INCLUDED
+
 #include <math.h>
+#include <stddef.h>
+
+// most partials a note may get, the budget below decides how many it needs
+#define MAX_MODES_AMOUNT 64
+#define MAX_MODES_AMOUNT_HQ 128
+// the spectral engine's cost hardly depends on the partial count
+#define MAX_MODES_AMOUNT_SPECTRAL 512
+
+// partials quieter than the loudest one by more than this are dropped
+#define MODES_RANGE_DB 60.f
+#define MODES_RANGE_DB_HQ 80.f
+
+// a partial is masked when it sits this far below a lower partial,
+// the masking threshold falls by the slope per octave above that partial
+#define MODES_MASKING_OFFSET_DB 30.f
+#define MODES_MASKING_SLOPE_DB 12.f
 
-#define MAX_MODES_AMOUNT 32
-#define MAX_MODES_AMOUNT_HQ 64
+// floor of the decay rate used to weight partials by how long they ring
+#define MODES_MIN_DECAY 0.05f
+
+// resonators are run in groups of this many, unused slots of the last group are silent
+#define MODES_GROUP 8
+#define MODES_GROUPS_MAX (MAX_MODES_AMOUNT_HQ / MODES_GROUP)
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -11,21 +34,35 @@
 #define STELL_STIFFNESS 0.1570795
 #define NYLON_STIFFNESS 0.0043196
 
+/*
+ * The resonators are packed, slot k renders partial mode_index[k] + 1 and
+ * only the first `modes` slots are processed. string_update picks the slots
+ * per note from the partials' level, decay and masking. With spectral set
+ * the modes are rendered by SpectralString instead, so the budget uses the
+ * HQ range with a cap of MAX_MODES_AMOUNT_SPECTRAL and the resonator
+ * coefficients are left alone.
+ *
+ * string_process runs the kernel for `groups` groups of MODES_GROUP slots,
+ * each kernel has a fixed trip count so the loop unrolls without a tail.
+ */
 typedef struct {
-    float b[MAX_MODES_AMOUNT_HQ];
-    float a1[MAX_MODES_AMOUNT_HQ];
-    float a2[MAX_MODES_AMOUNT_HQ];
+    float b[MAX_MODES_AMOUNT_SPECTRAL];
+    float a1[MAX_MODES_AMOUNT_SPECTRAL];
+    float a2[MAX_MODES_AMOUNT_SPECTRAL];
     
-    float x_[MAX_MODES_AMOUNT_HQ];
-    float y_[MAX_MODES_AMOUNT_HQ];
-    float y__[MAX_MODES_AMOUNT_HQ];
+    float y_[MAX_MODES_AMOUNT_SPECTRAL];
+    float y__[MAX_MODES_AMOUNT_SPECTRAL];
     
     float dynamic_y_;
     float velocity;
     float dynamic_coeff;
 
-    float amplitudes[MAX_MODES_AMOUNT_HQ];
-    float frequencies[MAX_MODES_AMOUNT_HQ];
+    float amplitudes[MAX_MODES_AMOUNT_SPECTRAL];
+    float frequencies[MAX_MODES_AMOUNT_SPECTRAL];
+    float decays[MAX_MODES_AMOUNT_SPECTRAL];
+    short mode_index[MAX_MODES_AMOUNT_SPECTRAL];
+    int modes;
+    int groups;
     
     float material;
     float position;
@@ -45,33 +82,90 @@ typedef struct {
     float excitation;
 
     short hq;
+    short spectral;
+    // caps the partials considered, 0 leaves it to the budget
+    int limit;
+
+    // changes whenever string_update rebuilds the mode table
+    unsigned int table;
 } PluckedString ;
 
+// a mode table string_modes computed for one frequency, the arrays are packed like the string's
+typedef struct {
+    float b[MAX_MODES_AMOUNT_SPECTRAL];
+    float a1[MAX_MODES_AMOUNT_SPECTRAL];
+    float a2[MAX_MODES_AMOUNT_SPECTRAL];
+
+    float amplitudes[MAX_MODES_AMOUNT_SPECTRAL];
+    float frequencies[MAX_MODES_AMOUNT_SPECTRAL];
+    float decays[MAX_MODES_AMOUNT_SPECTRAL];
+    short mode_index[MAX_MODES_AMOUNT_SPECTRAL];
+    int modes;
+
+    float frequency;
+} StringModes ;
+
+// distinct frequencies a block needs tables for
+#define STRING_BATCH_SIZE 16
+
+/*
+ * Tables computed ahead of the notes that need them, so a chord pays for
+ * its updates in one pass before rendering. They are only valid for strings
+ * with the settings string_batch_update was given.
+ */
+typedef struct {
+    StringModes tables[STRING_BATCH_SIZE];
+    int count;
+} StringBatch ;
+
 void string_init(PluckedString *string, unsigned long sample_rate, float A4) {
     string->sample_rate = sample_rate;
     string->A4 = A4;
     
     string->updated = 0;
+    string->modes = 0;
+    string->groups = 0;
 
-    for (int i = 0; i < MAX_MODES_AMOUNT_HQ; i++) {
-        string->amplitudes[i] = 0;
-        string->x_[i] = 0;
-        string->y_[i] = 0;
-        string->y__[i] = 0;
-    }
+    string->material = NYLON_STIFFNESS;
+    string->position = 0.5f;
+    string->decay = 0.f;
+    string->damping = 0.f;
+    string->width = 0.f;
+    string->harmonics = 0;
+    string->hq = 0;
+    string->spectral = 0;
+    string->limit = 0;
+    string->table = 0;
+    string->excitation = 0.f;
     
     string->dynamic_y_ = 0.f;
 }
 
+// silences the resonators and keeps the mode table
+void string_reset(PluckedString *string) {
+    for (int i = 0; i < MAX_MODES_AMOUNT_SPECTRAL; i++) {
+        string->y_[i] = 0.f;
+        string->y__[i] = 0.f;
+    }
+
+    string->excitation = 0.f;
+    string->dynamic_y_ = 0.f;
+}
+
 void string_sethq(PluckedString *string, short hq) {
     string->hq = hq;
+    string->modes = 0;
+    string->updated = 0;
+}
 
-    for (int i = 0; i < MAX_MODES_AMOUNT_HQ; i++) {
-        string->amplitudes[i] = 0;
-        string->x_[i] = 0;
-        string->y_[i] = 0;
-        string->y__[i] = 0;
-    }
+void string_setspectral(PluckedString *string, short spectral) {
+    string->spectral = spectral;
+    string->updated = 0;
+}
+
+void string_setlimit(PluckedString *string, int limit) {
+    string->limit = limit;
+    string->updated = 0;
 }
 
 void string_setmaterial(PluckedString *string, float material) {
@@ -101,52 +195,243 @@ void string_setfrequency(PluckedString *string, float f0) {
 
 void string_setharmonics(PluckedString *string, short harmonics) {
     string->harmonics = harmonics;
+    string->updated = 0;
+}
+
+// computes the mode table the string's settings give at a frequency, the string is left alone
+void string_modes(const PluckedString *string, float frequency, StringModes *table) {
+    int max_modes = string->hq ? MAX_MODES_AMOUNT_HQ : MAX_MODES_AMOUNT;
+    float range = string->hq ? MODES_RANGE_DB_HQ : MODES_RANGE_DB;
+    if (string->spectral) {
+        max_modes = MAX_MODES_AMOUNT_SPECTRAL;
+        range = MODES_RANGE_DB_HQ;
+    }
+    if (string->limit > 0 && string->limit < max_modes)
+        max_modes = string->limit;
+    float limit = (float) string->sample_rate / 2.f;
+    if (limit > 20000)
+        limit = 20000;
+
+    float freqs[MAX_MODES_AMOUNT_SPECTRAL];
+    float amps[MAX_MODES_AMOUNT_SPECTRAL];
+    float decays[MAX_MODES_AMOUNT_SPECTRAL];
+    float levels[MAX_MODES_AMOUNT_SPECTRAL];
+
+    float tension = frequency * frequency * 4.f;
+    float stiffness = string->material / tension * 9.86960440109;
+
+    // partials from this one on are rolled off by the pick width
+    float pick = string->width > 0.f ? 2.f / ( (float) M_PI * string->width) : (float) MAX_MODES_AMOUNT_SPECTRAL + 1.f;
+    float shape = 2.f / ( (float) (M_PI * M_PI) * string->position * (1.f - string->position) );
+
+    // the range as an energy ratio, partials are compared in dB only once they pass it
+    float floor = powf(10.f, -range / 10.f);
+    float loudest = 0.f;
+    int candidates = 0;
+
+    for (int i = 0; i < max_modes; i++) {
+        // calculate overtone frequencies
+        float n = (float) i + 1.f;
+        float freq = sqrtf(1.f + (stiffness * stiffness) * (n * n) ) * frequency * n;
+        if (freq >= limit)
+            break;
+
+        float envelope = shape / (n * n);
+        envelope *= n >= pick ? pick / n : 1.f;
+
+        float decay = string->decay + string->damping * freq * 2.f * (float) M_PI;
+        float weight = 1.f / (decay > MODES_MIN_DECAY ? decay : MODES_MIN_DECAY);
+
+        // the envelope and the weight only fall with n, no later partial can make the range
+        if (envelope * envelope * weight < loudest * floor)
+            break;
+
+        float amp = envelope * sinf( (float) M_PI * n * string->position);
+
+        freqs[i] = freq;
+        amps[i] = amp;
+        decays[i] = decay;
+
+        // energy of the decaying partial, natural harmonics drop the odd ones
+        levels[i] = string->harmonics && (i % 2) == 0 ? 0.f : amp * amp * weight;
+
+        if (levels[i] > loudest)
+            loudest = levels[i];
+
+        candidates++;
+    }
+
+    // keep the partials within range of the loudest one that no lower partial masks
+    int modes = 0;
+    float threshold = loudest * floor;
+    float mask = -1e30f;
+
+    for (int i = 0; i < candidates; i++) {
+        if (i > 0)
+            mask -= MODES_MASKING_SLOPE_DB * log2f(freqs[i] / freqs[i - 1]);
+
+        if (levels[i] < threshold || levels[i] <= 0.f)
+            continue;
+
+        float level = 10.f * log10f(levels[i]);
+        if (level >= mask) {
+            table->mode_index[modes] = (short) i;
+            table->frequencies[modes] = freqs[i];
+            table->amplitudes[modes] = amps[i];
+            table->decays[modes] = decays[i];
+            modes++;
+        }
+
+        if (level - MODES_MASKING_OFFSET_DB > mask)
+            mask = level - MODES_MASKING_OFFSET_DB;
+    }
+
+    table->frequency = frequency;
+    table->modes = modes;
+
+    if (string->spectral)
+        return;
+
+    float period = 1.f / (float) string->sample_rate;
+    float omega = 2.f * (float) M_PI * period;
+
+    for (int k = 0; k < modes; k++) {
+        float radius = expf(-table->decays[k] * period);
+
+        table->b[k] = table->amplitudes[k] * radius * sinf(omega * table->frequencies[k]);
+        table->a1[k] = -2.f * radius * cosf(omega * table->frequencies[k]);
+        table->a2[k] = radius * radius;
+    }
+}
+
+// previous output of a resonator moved from a1, a2 to new_a1, new_a2 that keeps the amplitude and phase of its state
+float string_carry(float a1, float a2, float new_a1, float new_a2, float y_, float y__) {
+    float r = sqrtf(a2);
+    float new_r = sqrtf(new_a2);
+    if (r <= 0.f || new_r <= 0.f)
+        return 0.f;
+
+    float c = -a1 / (2.f * r);
+    float new_c = -new_a1 / (2.f * new_r);
+    float s = sqrtf(fmaxf(1.f - c * c, 0.f) );
+    float new_s = sqrtf(fmaxf(1.f - new_c * new_c, 0.f) );
+    if (s < 1e-6f)
+        return 0.f;
+
+    // y_ = A sin(phase), r y__ = A sin(phase - w)
+    float quadrature = (y_ * c - r * y__) / s;
+    return (y_ * new_c - quadrature * new_s) / new_r;
+}
+
+// switches the string to a table string_modes computed with its current settings,
+// only the table's first `modes` entries are read
+void string_settable(PluckedString *string, const StringModes *table) {
+    int modes = table->modes;
+
+    // partials kept from the previous table carry their state to their new slot
+    float y_[MAX_MODES_AMOUNT_SPECTRAL];
+    float y__[MAX_MODES_AMOUNT_SPECTRAL];
+
+    for (int k = 0, j = 0; k < modes; k++) {
+        while (j < string->modes && string->mode_index[j] < table->mode_index[k])
+            j++;
+
+        if (j < string->modes && string->mode_index[j] == table->mode_index[k]) {
+            y_[k] = string->y_[j];
+            y__[k] = string->y__[j];
+
+            // the raw state would ring louder or softer at the new frequency, so the
+            // resonator restarts with the amplitude and phase the partial had
+            if (!string->spectral && string->groups > 0)
+                y__[k] = string_carry(string->a1[j], string->a2[j], table->a1[k], table->a2[k], y_[k], y__[k]);
+        } else {
+            y_[k] = 0.f;
+            y__[k] = 0.f;
+        }
+    }
+
+    for (int k = 0; k < modes; k++) {
+        string->mode_index[k] = table->mode_index[k];
+        string->frequencies[k] = table->frequencies[k];
+        string->amplitudes[k] = table->amplitudes[k];
+        string->decays[k] = table->decays[k];
+
+        string->y_[k] = y_[k];
+        string->y__[k] = y__[k];
+    }
+
+    string->modes = modes;
+    string->groups = 0;
+
+    if (!string->spectral) {
+        for (int k = 0; k < modes; k++) {
+            string->b[k] = table->b[k];
+            string->a1[k] = table->a1[k];
+            string->a2[k] = table->a2[k];
+        }
+
+        string->groups = (modes + MODES_GROUP - 1) / MODES_GROUP;
+
+        for (int k = modes; k < string->groups * MODES_GROUP; k++) {
+            string->b[k] = 0.f;
+            string->a1[k] = 0.f;
+            string->a2[k] = 0.f;
+            string->y_[k] = 0.f;
+            string->y__[k] = 0.f;
+        }
+    }
+    
+    string->frequency = table->frequency;
+    string->dynamic_coeff = expf(-2.f * M_PI * (string->frequency / (float) string->sample_rate) );
+
+    string->table++;
+    string->updated = 1;
 }
 
 void string_update(PluckedString *string) {
     if (!string->updated) {
-        int modes = string->hq ? MAX_MODES_AMOUNT_HQ : MAX_MODES_AMOUNT;
-        float freq, n;
-        float freq_coeff;
-        float decay;
-
-        for (int i = 0; i < modes; i++) {
-            // calculate overtone frequencies
-            if (freq >= (float) string->sample_rate / 2.f || freq >= 20000)
-                break;
-                
-            float tension = string->frequency * string->frequency * 4.f;
-            float stiffness = 0.f;
-
-            stiffness = string->material / tension * 9.86960440109;
-
-            n = (float) i + 1.f;
-            freq_coeff = sqrtf(1.f + (stiffness * stiffness) * (n * n) );
-            freq = sqrtf(1.f + (stiffness * stiffness) * (n * n) );
-            freq = freq_coeff * string->frequency * n;
-            string->frequencies[i] = freq;
-
-            string->amplitudes[i] = 2.f;
-            string->amplitudes[i] /= (M_PI * M_PI) * (n * n) * string->position * (1.f - string->position);
-            string->amplitudes[i] *= sinf( (M_PI * n * string->position) / 1.f);
-            
-            if (n >= (2.f / (M_PI * string->width) ) )
-                string->amplitudes[i] *= (2.f / (M_PI * string->width * n) );
+        StringModes table;
+        string_modes(string, string->frequency, &table);
+        string_settable(string, &table);
+    }
+}
 
-            decay = (string->decay + string->damping * freq * 2.f * M_PI);
-            
-            float radius = expf(-decay / (float) string->sample_rate);
-            
-            string->b[i] = string->amplitudes[i] * radius * sinf(2.f * M_PI * (freq / (float) string->sample_rate) );
-            string->a1[i] = -2.f * radius * cosf(2.f * M_PI * (freq / (float) string->sample_rate) );
-            string->a2[i] = radius * radius;
-            
-        }
-        
-        string->dynamic_coeff = expf(-2.f * M_PI * (string->frequency / (float) string->sample_rate) );
+void string_batch_clear(StringBatch *batch) {
+    batch->count = 0;
+}
 
-        string->updated = 1;
+// queues a frequency, ones already queued and ones past STRING_BATCH_SIZE are dropped
+void string_batch_add(StringBatch *batch, float frequency) {
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->tables[i].frequency == frequency)
+            return;
     }
+
+    if (batch->count < STRING_BATCH_SIZE)
+        batch->tables[batch->count++].frequency = frequency;
+}
+
+// computes every queued table with the settings of string, one string_modes call each
+void string_batch_update(StringBatch *batch, const PluckedString *string) {
+    for (int i = 0; i < batch->count; i++)
+        string_modes(string, batch->tables[i].frequency, &batch->tables[i]);
+}
+
+// like string_update, but takes the table from the batch when it holds one for the frequency
+void string_update_batched(PluckedString *string, const StringBatch *batch) {
+    if (string->updated)
+        return;
+
+    if (batch != NULL) {
+        for (int i = 0; i < batch->count; i++) {
+            if (batch->tables[i].frequency == string->frequency) {
+                string_settable(string, &batch->tables[i]);
+                return;
+            }
+        }
+    }
+
+    string_update(string);
 }
 
 void string_noteon(PluckedString *string, float velocity) {
@@ -156,38 +441,45 @@ void string_noteon(PluckedString *string, float velocity) {
 
 void string_setwidth(PluckedString *string, float width) {
     string->width = width * 0.1;
+    string->updated = 0;
+}
+
+#define STRING_KERNEL(groups) \
+float string_kernel_##groups(PluckedString *string) { \
+    float sum = 0.f; \
+    float excitation = string->excitation; \
+    for (int i = 0; i < groups * MODES_GROUP; i++) { \
+        float output = excitation * string->b[i] - string->a1[i] * string->y_[i] - string->a2[i] * string->y__[i]; \
+        string->y__[i] = string->y_[i]; \
+        string->y_[i] = output; \
+        sum += output; \
+    } \
+    return sum; \
 }
 
+STRING_KERNEL(0) STRING_KERNEL(1) STRING_KERNEL(2) STRING_KERNEL(3)
+STRING_KERNEL(4) STRING_KERNEL(5) STRING_KERNEL(6) STRING_KERNEL(7)
+STRING_KERNEL(8) STRING_KERNEL(9) STRING_KERNEL(10) STRING_KERNEL(11)
+STRING_KERNEL(12) STRING_KERNEL(13) STRING_KERNEL(14) STRING_KERNEL(15)
+STRING_KERNEL(16)
+
+float (*const string_kernels[MODES_GROUPS_MAX + 1])(PluckedString *) = {
+    string_kernel_0, string_kernel_1, string_kernel_2, string_kernel_3,
+    string_kernel_4, string_kernel_5, string_kernel_6, string_kernel_7,
+    string_kernel_8, string_kernel_9, string_kernel_10, string_kernel_11,
+    string_kernel_12, string_kernel_13, string_kernel_14, string_kernel_15,
+    string_kernel_16
+};
+
 float string_process(PluckedString *string) {
-    float sum = 0.f;
-    float output = 0.f;
-    
-    int modes = string->hq ? MAX_MODES_AMOUNT_HQ : MAX_MODES_AMOUNT;
-    
-    for (int i = 0; i < modes; i++) {
-        if (string->frequencies[i] >= (float) string->sample_rate / 2.f || string->frequencies[i]  >= 20000)
-            break;
-        output = (string->excitation * string->b[i] - string->a1[i] * string->y_[i] - string->a2[i] * string->y__[i]);
-        string->y__[i] = string->y_[i];
-        string->y_[i] = output;
-        string->x_[i] = string->excitation;
-        
-        float harmonic_on = 1.f;
-        
-        if (string->harmonics) {
-            if (((i + 1) % 2) != 0)
-                harmonic_on = 0.f;
-        }
-        
-        sum += output * harmonic_on;
-    }
+    float output = 0.1 * string_kernels[string->groups](string);
     
-    if (string->excitation == 1.f)
-        string->excitation = 0.f;    
+    string->excitation = 0.f;
         
-    output = 0.1 * sum;
     string->dynamic_y_ = (1.f - string->dynamic_coeff) * output + string->dynamic_y_ * string->dynamic_coeff;
     output = output * string->velocity + (1.f - string->velocity) * 1.41421356237 * string->dynamic_y_;
             
     return output * string->velocity;
 }
+
+#endif // PLUCKEDSTRING_H_INCLUDED
@@ -0,0 +1,305 @@
+#ifndef SPECTRALSTRING_H_INCLUDED
+#define SPECTRALSTRING_H_INCLUDED
+
+#include <stdlib.h>
+#include <math.h>
+#include "PluckedString.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif // M_PI
+
+#define SPECTRAL_FFT_SIZE 512
+#define SPECTRAL_HOP (SPECTRAL_FFT_SIZE / 4)
+
+// bins each partial is spread over, the main lobe of the window is 4 bins wide each side
+#define SPECTRAL_KERNEL_HALF_WIDTH 4
+#define SPECTRAL_KERNEL_WIDTH (2 * SPECTRAL_KERNEL_HALF_WIDTH + 1)
+#define SPECTRAL_KERNEL_RANGE (SPECTRAL_KERNEL_HALF_WIDTH + 1)
+#define SPECTRAL_KERNEL_OVERSAMPLE 64
+#define SPECTRAL_KERNEL_SIZE (2 * SPECTRAL_KERNEL_RANGE * SPECTRAL_KERNEL_OVERSAMPLE + 1)
+
+// below this squared amplitude a silent string skips the inverse fft
+#define SPECTRAL_SILENCE 1e-14f
+
+// depend on neither the sample rate nor the string, so one copy serves every SpectralString
+typedef struct {
+    float cos_table[SPECTRAL_FFT_SIZE / 2];
+    float sin_table[SPECTRAL_FFT_SIZE / 2];
+    int bit_reverse[SPECTRAL_FFT_SIZE];
+
+    float kernel[SPECTRAL_KERNEL_SIZE];
+    float post_window[SPECTRAL_FFT_SIZE / 2];
+} SpectralTables ;
+
+/*
+ * Additive resynthesis of a PluckedString's modes by overlap-add inverse FFT.
+ *
+ * Every partial is a complex phasor at the centre of the next frame, rotated
+ * and decayed once per hop and added to the spectrum through the transform of
+ * a 4-term Blackman-Harris window. One inverse FFT per hop turns the spectrum
+ * into a windowed frame, which is reshaped into triangles that overlap-add to
+ * one. The work per partial is per hop rather than per sample, so the cost
+ * barely depends on how many partials sound. Onsets are quantised to the hop
+ * and fade in over one hop.
+ */
+typedef struct {
+    const SpectralTables *tables;
+
+    float real[SPECTRAL_FFT_SIZE];
+    float imag[SPECTRAL_FFT_SIZE];
+
+    float overlap[SPECTRAL_HOP];
+    float output[SPECTRAL_HOP];
+    int output_pos;
+
+    // packed like the modes of the string they follow
+    float phasor_re[MAX_MODES_AMOUNT_SPECTRAL];
+    float phasor_im[MAX_MODES_AMOUNT_SPECTRAL];
+    float rotate_re[MAX_MODES_AMOUNT_SPECTRAL];
+    float rotate_im[MAX_MODES_AMOUNT_SPECTRAL];
+    float weights[MAX_MODES_AMOUNT_SPECTRAL][SPECTRAL_KERNEL_WIDTH];
+    int bins[MAX_MODES_AMOUNT_SPECTRAL];
+    short mode_index[MAX_MODES_AMOUNT_SPECTRAL];
+    int partials;
+
+    float dynamic_y_;
+    float velocity;
+    float dynamic_coeff;
+
+    unsigned long sample_rate;
+} SpectralString ;
+
+float spectral_window(int n) {
+    float x = 2.f * M_PI * n / SPECTRAL_FFT_SIZE;
+    return 0.35875f - 0.48829f * cosf(x) + 0.14128f * cosf(2.f * x) - 0.01168f * cosf(3.f * x);
+}
+
+// silences the string and forgets its partials
+void spectral_reset(SpectralString *spectral, unsigned long sample_rate) {
+    spectral->sample_rate = sample_rate;
+
+    for (int i = 0; i < SPECTRAL_HOP; i++) {
+        spectral->overlap[i] = 0.f;
+        spectral->output[i] = 0.f;
+    }
+    spectral->output_pos = SPECTRAL_HOP;
+
+    spectral->partials = 0;
+    spectral->dynamic_y_ = 0.f;
+    spectral->velocity = 1.f;
+    spectral->dynamic_coeff = 0.f;
+}
+
+void spectral_tables_init(SpectralTables *tables) {
+    for (int i = 0; i < SPECTRAL_FFT_SIZE / 2; i++) {
+        tables->cos_table[i] = cosf(2.f * M_PI * i / SPECTRAL_FFT_SIZE);
+        tables->sin_table[i] = sinf(2.f * M_PI * i / SPECTRAL_FFT_SIZE);
+    }
+
+    int bits = 0;
+    while ((1 << bits) < SPECTRAL_FFT_SIZE)
+        bits++;
+
+    for (int i = 0; i < SPECTRAL_FFT_SIZE; i++) {
+        int reversed = 0;
+        for (int b = 0; b < bits; b++)
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        tables->bit_reverse[i] = reversed;
+    }
+
+    // transform of the window centred on sample 0, real since the window is symmetric
+    for (int i = 0; i < SPECTRAL_KERNEL_SIZE; i++) {
+        float x = (float) (i - SPECTRAL_KERNEL_RANGE * SPECTRAL_KERNEL_OVERSAMPLE) / SPECTRAL_KERNEL_OVERSAMPLE;
+        double sum = 0.0;
+
+        for (int n = 0; n < SPECTRAL_FFT_SIZE; n++)
+            sum += spectral_window(n) * cos(2.0 * M_PI * x * (n - SPECTRAL_FFT_SIZE / 2) / SPECTRAL_FFT_SIZE);
+
+        tables->kernel[i] = (float) (sum / SPECTRAL_FFT_SIZE);
+    }
+
+    // turns the middle half of the window into a triangle, triangles a hop apart add up to one
+    for (int i = 0; i < SPECTRAL_FFT_SIZE / 2; i++) {
+        int n = SPECTRAL_FFT_SIZE / 4 + i;
+        float triangle = 1.f - fabsf( (float) (n - SPECTRAL_FFT_SIZE / 2) ) / SPECTRAL_HOP;
+        tables->post_window[i] = triangle / spectral_window(n);
+    }
+}
+
+// tables come from spectral_tables_init and must outlive the string
+void spectral_init(SpectralString *spectral, const SpectralTables *tables, unsigned long sample_rate) {
+    spectral->tables = tables;
+    spectral_reset(spectral, sample_rate);
+}
+
+float spectral_kernel(SpectralString *spectral, float x) {
+    float pos = (x + SPECTRAL_KERNEL_RANGE) * SPECTRAL_KERNEL_OVERSAMPLE;
+    int i = (int) pos;
+    if (i < 0 || i >= SPECTRAL_KERNEL_SIZE - 1)
+        return 0.f;
+
+    const float *kernel = spectral->tables->kernel;
+    float frac = pos - (float) i;
+    return kernel[i] + frac * (kernel[i + 1] - kernel[i]);
+}
+
+// follows the modes of the string after string_update, partials that stay keep their phasor
+void spectral_update(SpectralString *spectral, PluckedString *string) {
+    float sr = (float) string->sample_rate;
+    float phasor_re[MAX_MODES_AMOUNT_SPECTRAL];
+    float phasor_im[MAX_MODES_AMOUNT_SPECTRAL];
+
+    for (int k = 0, j = 0; k < string->modes; k++) {
+        while (j < spectral->partials && spectral->mode_index[j] < string->mode_index[k])
+            j++;
+
+        if (j < spectral->partials && spectral->mode_index[j] == string->mode_index[k]) {
+            phasor_re[k] = spectral->phasor_re[j];
+            phasor_im[k] = spectral->phasor_im[j];
+        } else {
+            phasor_re[k] = 0.f;
+            phasor_im[k] = 0.f;
+        }
+    }
+
+    for (int k = 0; k < string->modes; k++) {
+        float w = 2.f * M_PI * string->frequencies[k] / sr;
+        float decay = expf(-string->decays[k] * SPECTRAL_HOP / sr);
+        float bin = string->frequencies[k] * SPECTRAL_FFT_SIZE / sr;
+        int centre = (int) lrintf(bin);
+
+        spectral->mode_index[k] = string->mode_index[k];
+        spectral->phasor_re[k] = phasor_re[k];
+        spectral->phasor_im[k] = phasor_im[k];
+        spectral->rotate_re[k] = decay * cosf(w * SPECTRAL_HOP);
+        spectral->rotate_im[k] = decay * sinf(w * SPECTRAL_HOP);
+        spectral->bins[k] = centre - SPECTRAL_KERNEL_HALF_WIDTH;
+
+        // partials whose kernel would reach past nyquist stay silent
+        int audible = centre + SPECTRAL_KERNEL_HALF_WIDTH < SPECTRAL_FFT_SIZE / 2;
+        for (int j = 0; j < SPECTRAL_KERNEL_WIDTH; j++)
+            spectral->weights[k][j] = audible ? spectral_kernel(spectral, (float) (spectral->bins[k] + j) - bin) : 0.f;
+    }
+
+    spectral->partials = string->modes;
+    spectral->dynamic_coeff = string->dynamic_coeff;
+}
+
+// adds the pluck of string_noteon, each partial starts in sine phase at the next sample
+void spectral_noteon(SpectralString *spectral, PluckedString *string) {
+    float sr = (float) string->sample_rate;
+    // samples from the next output sample to the centre of the next frame, plus one like the resonators
+    int pending = spectral->output_pos >= SPECTRAL_HOP ? 0 : SPECTRAL_HOP - spectral->output_pos;
+    float age = (float) (pending + SPECTRAL_HOP + 1);
+
+    for (int k = 0; k < spectral->partials; k++) {
+        float w = 2.f * M_PI * string->frequencies[k] / sr;
+        float amp = string->amplitudes[k] * expf(-string->decays[k] * age / sr);
+        float phase = w * age - 0.5f * M_PI;
+
+        spectral->phasor_re[k] += amp * cosf(phase);
+        spectral->phasor_im[k] += amp * sinf(phase);
+    }
+
+    spectral->velocity = string->velocity;
+}
+
+void spectral_ifft(SpectralString *spectral) {
+    const SpectralTables *tables = spectral->tables;
+    float *re = spectral->real;
+    float *im = spectral->imag;
+
+    for (int i = 0; i < SPECTRAL_FFT_SIZE; i++) {
+        int j = tables->bit_reverse[i];
+        if (j > i) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for (int size = 2; size <= SPECTRAL_FFT_SIZE; size *= 2) {
+        int half = size / 2;
+        int step = SPECTRAL_FFT_SIZE / size;
+
+        for (int i = 0; i < SPECTRAL_FFT_SIZE; i += size) {
+            for (int k = 0; k < half; k++) {
+                float wr = tables->cos_table[k * step];
+                float wi = tables->sin_table[k * step];
+                int a = i + k;
+                int b = a + half;
+
+                float tr = wr * re[b] - wi * im[b];
+                float ti = wr * im[b] + wi * re[b];
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+void spectral_frame(SpectralString *spectral) {
+    float loudest = 0.f;
+
+    for (int i = 0; i < SPECTRAL_FFT_SIZE; i++) {
+        spectral->real[i] = 0.f;
+        spectral->imag[i] = 0.f;
+    }
+
+    for (int k = 0; k < spectral->partials; k++) {
+        float re = spectral->phasor_re[k];
+        float im = spectral->phasor_im[k];
+        float *weights = spectral->weights[k];
+
+        for (int j = 0; j < SPECTRAL_KERNEL_WIDTH; j++) {
+            int bin = (spectral->bins[k] + j) & (SPECTRAL_FFT_SIZE - 1);
+            spectral->real[bin] += weights[j] * re;
+            spectral->imag[bin] += weights[j] * im;
+        }
+
+        spectral->phasor_re[k] = re * spectral->rotate_re[k] - im * spectral->rotate_im[k];
+        spectral->phasor_im[k] = re * spectral->rotate_im[k] + im * spectral->rotate_re[k];
+
+        float magnitude = re * re + im * im;
+        if (magnitude > loudest)
+            loudest = magnitude;
+    }
+
+    if (loudest < SPECTRAL_SILENCE) {
+        for (int i = 0; i < SPECTRAL_HOP; i++) {
+            spectral->output[i] = spectral->overlap[i];
+            spectral->overlap[i] = 0.f;
+        }
+        return;
+    }
+
+    spectral_ifft(spectral);
+
+    const float *post_window = spectral->tables->post_window;
+
+    // the frame is centred on sample 0, so its middle half wraps around the ends of the buffer
+    for (int i = 0; i < SPECTRAL_HOP; i++) {
+        int first = (i + SPECTRAL_FFT_SIZE * 3 / 4) & (SPECTRAL_FFT_SIZE - 1);
+        int second = i;
+
+        spectral->output[i] = spectral->overlap[i] + spectral->real[first] * post_window[i];
+        spectral->overlap[i] = spectral->real[second] * post_window[SPECTRAL_HOP + i];
+    }
+}
+
+float spectral_process(SpectralString *spectral) {
+    if (spectral->output_pos >= SPECTRAL_HOP) {
+        spectral_frame(spectral);
+        spectral->output_pos = 0;
+    }
+
+    float output = 0.1 * spectral->output[spectral->output_pos++];
+    spectral->dynamic_y_ = (1.f - spectral->dynamic_coeff) * output + spectral->dynamic_y_ * spectral->dynamic_coeff;
+    output = output * spectral->velocity + (1.f - spectral->velocity) * 1.41421356237 * spectral->dynamic_y_;
+
+    return output * spectral->velocity;
+}
+
+#endif // SPECTRALSTRING_H_INCLUDED
@@ -0,0 +1,380 @@
+#ifndef SYMPATHETIC_H_INCLUDED
+#define SYMPATHETIC_H_INCLUDED
+
+#include <math.h>
+#include "PluckedString.h"
+
+// open strings of a guitar in standard tuning, as midi notes
+#define SYMPATHETIC_STRINGS 6
+#define SYMPATHETIC_OPEN_NOTES { 40, 45, 50, 55, 59, 64 }
+
+// lowest partials an open string keeps, one group of resonators, bounds the cost of the bank
+#define SYMPATHETIC_MODES MODES_GROUP
+#define SYMPATHETIC_SLOTS (SYMPATHETIC_STRINGS * SYMPATHETIC_MODES)
+
+// pairs are coupled this many at a time, a voice's last block is padded with pairs without weight
+#define SYMPATHETIC_PAIR_BLOCK 4
+
+// voices that can drive the bank, each drives an open string mode from at most one of its modes
+#define SYMPATHETIC_VOICES 16
+#define SYMPATHETIC_PAIRS (SYMPATHETIC_SLOTS + SYMPATHETIC_PAIR_BLOCK)
+
+// samples between two couplings
+#define SYMPATHETIC_CONTROL_SIZE 32
+
+// mode pairs further apart than this are not coupled
+#define SYMPATHETIC_TOLERANCE_CENTS 20.f
+
+// fraction of a driving mode's state passed to an exactly coincident mode per second at full amount
+#define SYMPATHETIC_COUPLING 0.05f
+
+// an open string mode stops rendering once it is this quiet and no voice drives it
+#define SYMPATHETIC_SILENCE 1e-6f
+
+/*
+ * Sympathetic resonance of the open strings.
+ *
+ * The open strings are modal strings that are never plucked. Every control
+ * period the state of each voice's modes is added to the open string modes
+ * within SYMPATHETIC_TOLERANCE_CENTS of them, weighted by how close they are,
+ * so a mode only rings along when a played partial is near its frequency.
+ *
+ * A voice's pairs are rebuilt only when its or an open string's mode table
+ * changes. They are stored as arrays in blocks of SYMPATHETIC_PAIR_BLOCK, so
+ * the multiply of a coupling runs on whole blocks, and each open string mode
+ * is driven by the closest voice mode only. Only the open string modes that
+ * are driven or still ring are rendered, they are packed into the
+ * resonators of `packed`, which hold their state. A mode joins at the end
+ * when a pair first drives it and the last one takes its place when it dies
+ * out, so the others never move.
+ */
+typedef struct {
+    short source[SYMPATHETIC_PAIRS];
+    // open string mode, string * SYMPATHETIC_MODES + mode
+    short target[SYMPATHETIC_PAIRS];
+    float weight[SYMPATHETIC_PAIRS];
+    // a whole number of blocks
+    int count;
+    // modes of each open string the voice drives, one bit each
+    unsigned int drives[SYMPATHETIC_STRINGS];
+
+    // table of the voice's string the pairs were built for
+    unsigned int table;
+    int valid;
+} SympatheticPairs ;
+
+typedef struct {
+    PluckedString strings[SYMPATHETIC_STRINGS];
+    unsigned int tables[SYMPATHETIC_STRINGS];
+
+    SympatheticPairs pairs[SYMPATHETIC_VOICES];
+
+    // the ringing modes in groups of MODES_GROUP, the unused slots of the last group are silent
+    PluckedString packed;
+    short packed_target[SYMPATHETIC_SLOTS];
+    int packed_count;
+    // slot in packed of each open string mode, then of the padding pairs, whose slots past the
+    // rendered ones take the adds without weight, one per lane so the adds stay independent
+    short slot[SYMPATHETIC_SLOTS + SYMPATHETIC_PAIR_BLOCK];
+
+    float gain;
+    // one bit per mode of each open string
+    unsigned int driven[SYMPATHETIC_STRINGS];
+    unsigned int ringing[SYMPATHETIC_STRINGS];
+    int active;
+
+    unsigned long sample_rate;
+} Sympathetic ;
+
+void sympathetic_init(Sympathetic *bank, unsigned long sample_rate) {
+    int notes[SYMPATHETIC_STRINGS] = SYMPATHETIC_OPEN_NOTES;
+
+    bank->sample_rate = sample_rate;
+    bank->gain = 0.f;
+    bank->active = 0;
+
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++) {
+        PluckedString *string = &bank->strings[s];
+
+        string_init(string, sample_rate, 440.f);
+        string_setlimit(string, SYMPATHETIC_MODES);
+        string_setfrequency(string, 440.f * powf(2.f, (notes[s] - 69.f) / 12.f) );
+        // driven at the bridge, so no partial sits on a node
+        string_setposition(string, 0.1f);
+
+        bank->tables[s] = 0;
+        bank->driven[s] = 0;
+        bank->ringing[s] = 0;
+    }
+
+    // never plucked, only the resonators of the packed string are used
+    string_init(&bank->packed, sample_rate, 440.f);
+    for (int i = 0; i < SYMPATHETIC_SLOTS + SYMPATHETIC_PAIR_BLOCK; i++) {
+        bank->packed.b[i] = 0.f;
+        bank->packed.a1[i] = 0.f;
+        bank->packed.a2[i] = 0.f;
+        bank->packed.y_[i] = 0.f;
+        bank->packed.y__[i] = 0.f;
+        bank->slot[i] = (short) (i < SYMPATHETIC_SLOTS ? SYMPATHETIC_SLOTS : i);
+    }
+    bank->packed_count = 0;
+
+    for (int v = 0; v < SYMPATHETIC_VOICES; v++) {
+        bank->pairs[v].count = 0;
+        bank->pairs[v].valid = 0;
+    }
+}
+
+void sympathetic_setamount(Sympathetic *bank, float amount) {
+    bank->gain = amount * SYMPATHETIC_COUPLING * SYMPATHETIC_CONTROL_SIZE / (float) bank->sample_rate;
+}
+
+void sympathetic_setmaterial(Sympathetic *bank, float material) {
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++)
+        string_setmaterial(&bank->strings[s], material);
+}
+
+void sympathetic_setdecay(Sympathetic *bank, float decay) {
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++)
+        string_setdecay(&bank->strings[s], decay);
+}
+
+void sympathetic_setdamping(Sympathetic *bank, float damping) {
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++)
+        string_setdamping(&bank->strings[s], damping);
+}
+
+// hands the state of the ringing modes back to the open strings
+void sympathetic_unpack(Sympathetic *bank) {
+    PluckedString *packed = &bank->packed;
+
+    for (int i = 0; i < bank->packed_count; i++) {
+        int t = bank->packed_target[i];
+        PluckedString *string = &bank->strings[t / SYMPATHETIC_MODES];
+
+        string->y_[t % SYMPATHETIC_MODES] = packed->y_[i];
+        string->y__[t % SYMPATHETIC_MODES] = packed->y__[i];
+    }
+}
+
+// takes the coefficients and the state of the ringing modes from the open strings
+void sympathetic_repack(Sympathetic *bank) {
+    PluckedString *packed = &bank->packed;
+
+    for (int i = 0; i < bank->packed_count; i++) {
+        int t = bank->packed_target[i];
+        PluckedString *string = &bank->strings[t / SYMPATHETIC_MODES];
+
+        packed->a1[i] = string->a1[t % SYMPATHETIC_MODES];
+        packed->a2[i] = string->a2[t % SYMPATHETIC_MODES];
+        packed->y_[i] = string->y_[t % SYMPATHETIC_MODES];
+        packed->y__[i] = string->y__[t % SYMPATHETIC_MODES];
+    }
+}
+
+// starts rendering the given modes of an open string, silent until they are coupled
+void sympathetic_wake(Sympathetic *bank, int s, unsigned int modes) {
+    PluckedString *packed = &bank->packed;
+    PluckedString *string = &bank->strings[s];
+
+    for (int m = 0; m < SYMPATHETIC_MODES; m++) {
+        if (!(modes & (1u << m)))
+            continue;
+
+        int i = bank->packed_count++;
+        int t = s * SYMPATHETIC_MODES + m;
+        bank->packed_target[i] = (short) t;
+        bank->slot[t] = (short) i;
+
+        packed->a1[i] = string->a1[m];
+        packed->a2[i] = string->a2[m];
+        packed->y_[i] = 0.f;
+        packed->y__[i] = 0.f;
+    }
+
+    bank->ringing[s] |= modes;
+    packed->groups = (bank->packed_count + MODES_GROUP - 1) / MODES_GROUP;
+    bank->active = 1;
+}
+
+// stops rendering an open string mode, the last packed mode moves into its slot
+void sympathetic_sleep(Sympathetic *bank, int t) {
+    PluckedString *packed = &bank->packed;
+    int i = bank->slot[t];
+    int last = --bank->packed_count;
+
+    if (i != last) {
+        int moved = bank->packed_target[last];
+        bank->packed_target[i] = (short) moved;
+        bank->slot[moved] = (short) i;
+
+        packed->a1[i] = packed->a1[last];
+        packed->a2[i] = packed->a2[last];
+        packed->y_[i] = packed->y_[last];
+        packed->y__[i] = packed->y__[last];
+    }
+
+    packed->a1[last] = 0.f;
+    packed->a2[last] = 0.f;
+    packed->y_[last] = 0.f;
+    packed->y__[last] = 0.f;
+
+    bank->slot[t] = SYMPATHETIC_SLOTS;
+    bank->ringing[t / SYMPATHETIC_MODES] &= ~(1u << (t % SYMPATHETIC_MODES) );
+    packed->groups = (bank->packed_count + MODES_GROUP - 1) / MODES_GROUP;
+    bank->active = bank->packed_count > 0;
+}
+
+void sympathetic_update(Sympathetic *bank) {
+    int changed = 0;
+
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++)
+        changed |= !bank->strings[s].updated;
+
+    if (!changed)
+        return;
+
+    // the strings carry the state of their modes to a new table themselves
+    sympathetic_unpack(bank);
+
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++) {
+        string_update(&bank->strings[s]);
+        bank->tables[s] = bank->strings[s].table;
+    }
+
+    sympathetic_repack(bank);
+
+    for (int v = 0; v < SYMPATHETIC_VOICES; v++)
+        bank->pairs[v].valid = 0;
+}
+
+void sympathetic_pair(Sympathetic *bank, SympatheticPairs *pairs, PluckedString *voice) {
+    float tolerance = powf(2.f, SYMPATHETIC_TOLERANCE_CENTS / 1200.f);
+    int count = 0;
+
+    // both tables are sorted by frequency, so each open string is one merge
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++) {
+        PluckedString *string = &bank->strings[s];
+        int k = 0;
+
+        pairs->drives[s] = 0;
+
+        for (int m = 0; m < string->modes; m++) {
+            float freq = string->frequencies[m];
+            float best = 0.f;
+
+            while (k < voice->modes && voice->frequencies[k] * tolerance < freq)
+                k++;
+
+            // the closest voice mode drives the open string mode
+            for (int j = k; j < voice->modes && voice->frequencies[j] < freq * tolerance; j++) {
+                float cents = fabsf(1200.f * log2f(voice->frequencies[j] / freq) );
+                float weight = 1.f - cents / SYMPATHETIC_TOLERANCE_CENTS;
+
+                if (weight > best) {
+                    best = weight;
+                    pairs->source[count] = (short) j;
+                }
+            }
+
+            if (best > 0.f) {
+                pairs->target[count] = (short) (s * SYMPATHETIC_MODES + m);
+                pairs->weight[count] = best;
+                pairs->drives[s] |= 1u << m;
+                count++;
+            }
+        }
+    }
+
+    // the padding lands in slots that are never rendered
+    for (int lane = 0; count % SYMPATHETIC_PAIR_BLOCK != 0; lane++) {
+        pairs->source[count] = 0;
+        pairs->target[count] = (short) (SYMPATHETIC_SLOTS + lane);
+        pairs->weight[count] = 0.f;
+        count++;
+    }
+
+    pairs->count = count;
+}
+
+// passes the state of a sounding voice's modes to the open strings, scaled by the voice's envelope
+// level so a released note stops driving them as it fades, a NULL voice is silent
+void sympathetic_couple(Sympathetic *bank, int index, PluckedString *voice, float level) {
+    if (index >= SYMPATHETIC_VOICES)
+        return;
+
+    SympatheticPairs *pairs = &bank->pairs[index];
+
+    if (voice == NULL || voice->spectral) {
+        pairs->valid = 0;
+        return;
+    }
+
+    if (!pairs->valid || pairs->table != voice->table) {
+        sympathetic_pair(bank, pairs, voice);
+        pairs->table = voice->table;
+        pairs->valid = 1;
+    }
+
+    if (bank->gain <= 0.f || level <= SYMPATHETIC_SILENCE || pairs->count == 0)
+        return;
+
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++) {
+        unsigned int fresh = pairs->drives[s] & ~bank->ringing[s];
+        if (fresh)
+            sympathetic_wake(bank, s, fresh);
+
+        bank->driven[s] |= pairs->drives[s];
+    }
+
+    float gain = bank->gain * level;
+    float *y_ = bank->packed.y_;
+    float *y__ = bank->packed.y__;
+
+    for (int p = 0; p < pairs->count; p += SYMPATHETIC_PAIR_BLOCK) {
+        const short *source = &pairs->source[p];
+        const short *target = &pairs->target[p];
+        const float *weight = &pairs->weight[p];
+
+        // the voice's modes are gathered and the packed ones scattered, the multiply runs on the whole block
+        float drive_y_[SYMPATHETIC_PAIR_BLOCK];
+        float drive_y__[SYMPATHETIC_PAIR_BLOCK];
+        for (int j = 0; j < SYMPATHETIC_PAIR_BLOCK; j++) {
+            drive_y_[j] = gain * weight[j] * voice->y_[source[j]];
+            drive_y__[j] = gain * weight[j] * voice->y__[source[j]];
+        }
+
+        for (int j = 0; j < SYMPATHETIC_PAIR_BLOCK; j++) {
+            int slot = bank->slot[target[j]];
+            y_[slot] += drive_y_[j];
+            y__[slot] += drive_y__[j];
+        }
+    }
+}
+
+// call once per control period before coupling, puts the open string modes that died out to sleep
+void sympathetic_control(Sympathetic *bank) {
+    for (int s = 0; s < SYMPATHETIC_STRINGS; s++) {
+        unsigned int quiet = bank->ringing[s] & ~bank->driven[s];
+        bank->driven[s] = 0;
+
+        for (int m = 0; quiet; m++, quiet >>= 1) {
+            if (!(quiet & 1u))
+                continue;
+
+            // as heard, two samples of state bound the mode's amplitude
+            int t = s * SYMPATHETIC_MODES + m;
+            int i = bank->slot[t];
+            float level = 0.1f * (fabsf(bank->packed.y_[i]) + fabsf(bank->packed.y__[i]) );
+            if (level < SYMPATHETIC_SILENCE)
+                sympathetic_sleep(bank, t);
+        }
+    }
+}
+
+float sympathetic_process(Sympathetic *bank) {
+    // the open strings are never plucked, so they skip string_process' velocity filter
+    return 0.1f * string_kernels[bank->packed.groups](&bank->packed);
+}
+
+#endif // SYMPATHETIC_H_INCLUDED
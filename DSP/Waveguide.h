@@ -0,0 +1,425 @@
+#ifndef WAVEGUIDE_H_INCLUDED
+#define WAVEGUIDE_H_INCLUDED
+
+#include <math.h>
+#include "DelayAllpass.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif // M_PI
+
+// dispersion allpass stages, each adds at most 2 samples of loop delay
+#define WAVEGUIDE_DISPERSION_STAGES 4
+#define WAVEGUIDE_DISPERSION_STAGES_HQ 8
+#define WAVEGUIDE_MIN_DISPERSION_COEFF (-1.f / 3.f)
+// coefficients closer to 0 only delay the loop, so the stages are dropped
+#define WAVEGUIDE_NEGLIGIBLE_DISPERSION_COEFF 1e-4f
+
+// the dispersion is fitted once at a bass's low E, stiffness stretches the lowest notes the most
+#define WAVEGUIDE_FIT_FUNDAMENTAL 41.2f
+
+// partial used to fit the dispersion and the frequency of the loss filter fit
+#define WAVEGUIDE_FIT_PARTIAL_FREQUENCY 4000.f
+#define WAVEGUIDE_MAX_FIT_PARTIAL 32
+
+// youngs modulus of strings, same as the modal string
+#define WAVEGUIDE_STELL_STIFFNESS 0.1570795
+#define WAVEGUIDE_NYLON_STIFFNESS 0.0043196
+
+/*
+ * Dispersive digital waveguide string.
+ *
+ * A single delay loop closed by a one-pole loss filter and a chain of
+ * first-order allpasses, so the cost per sample does not depend on pitch.
+ * The loss filter is fitted to the per-period decay the modal string applies
+ * at the fundamental and at WAVEGUIDE_FIT_PARTIAL_FREQUENCY, the allpass
+ * coefficient is fitted so one upper partial lands where the modal string's
+ * stiffness puts it at WAVEGUIDE_FIT_FUNDAMENTAL and scaled to other
+ * frequencies in closed form, and the pluck is injected as one period of the same
+ * triangle the modal string's amplitudes are the Fourier series of.
+ * Setters take the same 0..1 ranges as the PluckedString ones.
+ */
+typedef struct {
+    DelayAllpass delay;
+    DelayAllpass harmonic; // half period tap for natural harmonics
+
+    float dispersion_coeff;
+    float dispersion_fit; // coefficient at WAVEGUIDE_FIT_FUNDAMENTAL
+    int fitted;
+    float dispersion_x_[WAVEGUIDE_DISPERSION_STAGES_HQ];
+    float dispersion_y_[WAVEGUIDE_DISPERSION_STAGES_HQ];
+    int stages;
+
+    float loss_gain;
+    float loss_coeff;
+    float loss_y_;
+
+    float excitation_lowpass;
+    float excitation_y_;
+    float excitation_value;
+    float excitation_rise;
+    float excitation_fall;
+    int excitation_pos;
+    int excitation_peak;
+    int excitation_half;
+
+    float dynamic_y_;
+    float velocity;
+    float dynamic_coeff;
+
+    float material;
+    float position;
+    unsigned long sample_rate;
+
+    float decay;
+    float damping;
+    float width;
+
+    short harmonics;
+
+    int updated;
+
+    float frequency;
+
+    short hq;
+} Waveguide ;
+
+int waveguide_init(Waveguide *wg, unsigned long sample_rate) {
+    wg->sample_rate = sample_rate;
+    wg->updated = 0;
+    wg->fitted = 0;
+    wg->stages = 0;
+    wg->dispersion_coeff = 0.f;
+    wg->dispersion_fit = 0.f;
+
+    for (int i = 0; i < WAVEGUIDE_DISPERSION_STAGES_HQ; i++) {
+        wg->dispersion_x_[i] = 0;
+        wg->dispersion_y_[i] = 0;
+    }
+
+    wg->loss_gain = 0.f;
+    wg->loss_coeff = 0.f;
+    wg->loss_y_ = 0.f;
+
+    wg->excitation_pos = 0;
+    wg->excitation_half = 0;
+    wg->excitation_peak = 0;
+    wg->excitation_y_ = 0.f;
+
+    wg->dynamic_y_ = 0.f;
+    wg->velocity = 1.f;
+    wg->harmonics = 0;
+    wg->hq = 0;
+
+    int success = delayallpass_init(&wg->delay, sample_rate);
+    return delayallpass_init(&wg->harmonic, sample_rate) && success;
+}
+
+// silences the string and keeps its settings and filters
+void waveguide_reset(Waveguide *wg) {
+    for (int i = 0; i < WAVEGUIDE_DISPERSION_STAGES_HQ; i++) {
+        wg->dispersion_x_[i] = 0;
+        wg->dispersion_y_[i] = 0;
+    }
+
+    wg->loss_y_ = 0.f;
+
+    wg->excitation_pos = 0;
+    wg->excitation_half = 0;
+    wg->excitation_peak = 0;
+    wg->excitation_y_ = 0.f;
+
+    wg->dynamic_y_ = 0.f;
+
+    delayallpass_reset(&wg->delay);
+    delayallpass_reset(&wg->harmonic);
+}
+
+void waveguide_free(Waveguide *wg) {
+    delayallpass_free(&wg->delay);
+    delayallpass_free(&wg->harmonic);
+}
+
+void waveguide_sethq(Waveguide *wg, short hq) {
+    wg->hq = hq;
+    wg->updated = 0;
+    wg->fitted = 0;
+}
+
+void waveguide_setmaterial(Waveguide *wg, float material) {
+    wg->material = WAVEGUIDE_NYLON_STIFFNESS + (WAVEGUIDE_STELL_STIFFNESS - WAVEGUIDE_NYLON_STIFFNESS) * material;
+    wg->updated = 0;
+    wg->fitted = 0;
+}
+
+void waveguide_setposition(Waveguide *wg, float position) {
+    wg->position = position;
+}
+
+// the loss filter stretches the partials too, so the losses change the dispersion fit
+void waveguide_setdecay(Waveguide *wg, float decay) {
+    wg->decay = decay * 8.f;
+    wg->updated = 0;
+    wg->fitted = 0;
+}
+
+void waveguide_setdamping(Waveguide *wg, float damping) {
+    wg->damping = damping * 0.005;
+    wg->updated = 0;
+    wg->fitted = 0;
+}
+
+void waveguide_setfrequency(Waveguide *wg, float f0) {
+    wg->frequency = f0;
+    wg->updated = 0;
+}
+
+void waveguide_setharmonics(Waveguide *wg, short harmonics) {
+    wg->harmonics = harmonics;
+}
+
+void waveguide_setwidth(Waveguide *wg, float width) {
+    wg->width = width * 0.1;
+    wg->updated = 0;
+}
+
+// phase delay in samples of (c + z^-1) / (1 + c z^-1)
+float waveguide_allpass_delay(float c, float w) {
+    float phase = atan2f(-sinf(w), c + cosf(w)) - atan2f(-c * sinf(w), 1.f + c * cosf(w));
+    return -phase / w;
+}
+
+// phase delay in samples of g (1 + a) / (1 + a z^-1)
+float waveguide_loss_delay(float a, float w) {
+    return atan2f(-a * sinf(w), 1.f + a * cosf(w)) / w;
+}
+
+// lowest partial of a loop with the given fixed line length, found by fixed point iteration
+float waveguide_partial(float line, float loss_coeff, int stages, float c, int partial) {
+    float w = 2.f * M_PI * partial / line;
+
+    for (int i = 0; i < 8; i++) {
+        float total = line + waveguide_loss_delay(loss_coeff, w) + stages * waveguide_allpass_delay(c, w);
+        w = 2.f * M_PI * partial / total;
+    }
+
+    return w;
+}
+
+// per period gain of a partial at freq on the modal string
+float waveguide_target_gain(const Waveguide *wg, float fundamental, float freq) {
+    return expf(-(wg->decay + wg->damping * freq * 2.f * M_PI) / fundamental);
+}
+
+// stiffness as in string_update, partials at n f0 sqrt(1 + B n^2)
+float waveguide_inharmonicity(const Waveguide *wg, float frequency) {
+    float tension = frequency * frequency * 4.f;
+    float stiffness = wg->material / tension * 9.86960440109;
+    return stiffness * stiffness;
+}
+
+// loss filter, fit the gain at the fundamental and the one-pole slope above it
+void waveguide_fitloss(const Waveguide *wg, float fundamental, float *loss_coeff, float *loss_gain) {
+    float sr = (float) wg->sample_rate;
+    float w1 = 2.f * M_PI * fundamental / sr;
+    float g = waveguide_target_gain(wg, fundamental, fundamental);
+
+    float fit = WAVEGUIDE_FIT_PARTIAL_FREQUENCY;
+    if (fit > sr * 0.25f)
+        fit = sr * 0.25f;
+
+    float a = 0.f;
+    if (fit > fundamental) {
+        float r = waveguide_target_gain(wg, fundamental, fit) / g;
+        float c = cosf(2.f * M_PI * fit / sr);
+        // |g (1 + a) / (1 + a e^-jw)| = g r solved for a, the root inside the unit circle
+        float qa = r * r - 1.f;
+        float qb = 2.f * (r * r * c - 1.f);
+        if (qa < -1e-9f) {
+            float disc = qb * qb - 4.f * qa * qa;
+            if (disc < 0.f)
+                disc = 0.f;
+            a = (-qb - sqrtf(disc)) / (2.f * qa);
+            if (a < -0.999f)
+                a = -0.999f;
+        }
+    }
+    *loss_coeff = a;
+
+    // unity slope at DC, so scale the gain to hit the target at the fundamental
+    *loss_gain = g * sqrtf(1.f + 2.f * a * cosf(w1) + a * a);
+    if (*loss_gain > 0.99999f * (1.f + a))
+        *loss_gain = 0.99999f * (1.f + a);
+}
+
+// bisects the coefficient until the fit partial of WAVEGUIDE_FIT_FUNDAMENTAL lands on the target,
+// the loss filter already stretches the partials, so this is often 0
+void waveguide_fit(Waveguide *wg) {
+    float sr = (float) wg->sample_rate;
+    float inharmonicity = waveguide_inharmonicity(wg, WAVEGUIDE_FIT_FUNDAMENTAL);
+    float fundamental = WAVEGUIDE_FIT_FUNDAMENTAL * sqrtf(1.f + inharmonicity);
+    float period = sr / fundamental;
+    float w1 = 2.f * M_PI * fundamental / sr;
+
+    float loss_coeff, loss_gain;
+    waveguide_fitloss(wg, fundamental, &loss_coeff, &loss_gain);
+    float loss_delay = waveguide_loss_delay(loss_coeff, w1);
+
+    int stages = wg->hq ? WAVEGUIDE_DISPERSION_STAGES_HQ : WAVEGUIDE_DISPERSION_STAGES;
+
+    int partial = (int) (WAVEGUIDE_FIT_PARTIAL_FREQUENCY / fundamental);
+    if (partial > WAVEGUIDE_MAX_FIT_PARTIAL)
+        partial = WAVEGUIDE_MAX_FIT_PARTIAL;
+
+    float target = partial * sqrtf(1.f + inharmonicity * partial * partial) / sqrtf(1.f + inharmonicity);
+    float lo = WAVEGUIDE_MIN_DISPERSION_COEFF, hi = 0.f;
+
+    for (int i = 0; i < 16; i++) {
+        float mid = 0.5f * (lo + hi);
+        float line = period - loss_delay - stages * waveguide_allpass_delay(mid, w1);
+        float ratio = waveguide_partial(line, loss_coeff, stages, mid, partial) / waveguide_partial(line, loss_coeff, stages, mid, 1);
+        // more negative coefficients stretch the partials further
+        if (ratio < target)
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    // the bisection never reaches 0 itself, so a fit that stayed next to it means no dispersion
+    float coeff = 0.5f * (lo + hi);
+    wg->dispersion_fit = coeff > -WAVEGUIDE_NEGLIGIBLE_DISPERSION_COEFF ? 0.f : coeff;
+    wg->fitted = 1;
+}
+
+void waveguide_update(Waveguide *wg) {
+    if (!wg->updated) {
+        float sr = (float) wg->sample_rate;
+
+        if (!wg->fitted)
+            waveguide_fit(wg);
+
+        float inharmonicity = waveguide_inharmonicity(wg, wg->frequency);
+        float fundamental = wg->frequency * sqrtf(1.f + inharmonicity);
+        float period = sr / fundamental;
+        float w1 = 2.f * M_PI * fundamental / sr;
+
+        waveguide_fitloss(wg, fundamental, &wg->loss_coeff, &wg->loss_gain);
+        float loss_delay = waveguide_loss_delay(wg->loss_coeff, w1);
+
+        // the stretch of stiffness falls with the fourth power of the frequency and the one a small
+        // coefficient gives grows with the third power of w1, so the fitted coefficient scales with the
+        // seventh power and a bend needs no new fit
+        float coeff = 0.f;
+        if (wg->dispersion_fit < 0.f) {
+            float ratio = WAVEGUIDE_FIT_FUNDAMENTAL / wg->frequency;
+            float ratio2 = ratio * ratio;
+            coeff = wg->dispersion_fit * ratio2 * ratio2 * ratio2 * ratio;
+            if (coeff < WAVEGUIDE_MIN_DISPERSION_COEFF)
+                coeff = WAVEGUIDE_MIN_DISPERSION_COEFF;
+        }
+
+        // every stage may add up to 2 samples of delay, keep at least 2 for the line
+        int stages = 0;
+        if (coeff < -WAVEGUIDE_NEGLIGIBLE_DISPERSION_COEFF) {
+            stages = wg->hq ? WAVEGUIDE_DISPERSION_STAGES_HQ : WAVEGUIDE_DISPERSION_STAGES;
+            int room = (int) ((period - loss_delay - 2.f) / 2.f);
+            if (stages > room)
+                stages = room > 0 ? room : 0;
+        }
+        if (stages == 0)
+            coeff = 0.f;
+        wg->stages = stages;
+        wg->dispersion_coeff = coeff;
+
+        float line = period - loss_delay;
+        if (stages > 0)
+            line -= stages * waveguide_allpass_delay(coeff, w1);
+        delayallpass_set(&wg->delay, line);
+        delayallpass_set(&wg->harmonic, period * 0.5f);
+
+        // pick width roll-off, one-pole at the partial string_update starts attenuating
+        wg->excitation_lowpass = 0.f;
+        if (wg->width > 0.f)
+            wg->excitation_lowpass = expf(-2.f * M_PI * fundamental * (2.f / (M_PI * wg->width) ) / sr);
+
+        wg->dynamic_coeff = expf(-2.f * M_PI * (wg->frequency / sr) );
+
+        wg->updated = 1;
+    }
+}
+
+void waveguide_noteon(Waveguide *wg, float velocity) {
+    wg->velocity = velocity;
+
+    // one period of the odd extension of the triangle, peaking at the pluck position
+    int half = (int) ((float) wg->sample_rate / wg->frequency * 0.5f);
+    if (half < 2)
+        half = 2;
+
+    int peak = (int) (wg->position * half);
+    if (peak < 1)
+        peak = 1;
+    if (peak > half - 1)
+        peak = half - 1;
+
+    wg->excitation_half = half;
+    wg->excitation_peak = peak;
+    wg->excitation_rise = 1.f / peak;
+    wg->excitation_fall = 1.f / (half - peak);
+
+    wg->excitation_pos = 0;
+    wg->excitation_value = 0.f;
+}
+
+float waveguide_excitation(Waveguide *wg) {
+    int pos = wg->excitation_pos;
+    int period = 2 * wg->excitation_half;
+
+    if (pos >= period)
+        return 0.f;
+
+    float value = wg->excitation_value;
+
+    if (pos < wg->excitation_peak || pos >= period - wg->excitation_peak)
+        wg->excitation_value += wg->excitation_rise;
+    else
+        wg->excitation_value -= wg->excitation_fall;
+
+    wg->excitation_pos++;
+
+    return value;
+}
+
+float waveguide_process(Waveguide *wg) {
+    float out = delayallpass_read(&wg->delay);
+
+    float loop = wg->loss_gain * out - wg->loss_coeff * wg->loss_y_;
+    wg->loss_y_ = loop;
+
+    float c = wg->dispersion_coeff;
+    for (int i = 0; i < wg->stages; i++) {
+        float y = c * loop + wg->dispersion_x_[i] - c * wg->dispersion_y_[i];
+        wg->dispersion_x_[i] = loop;
+        wg->dispersion_y_[i] = y;
+        loop = y;
+    }
+
+    float excitation = waveguide_excitation(wg);
+    wg->excitation_y_ = (1.f - wg->excitation_lowpass) * excitation + wg->excitation_lowpass * wg->excitation_y_;
+
+    loop += wg->excitation_y_;
+    delayallpass_write(&wg->delay, loop);
+
+    // a half period delay cancels every odd partial
+    delayallpass_write(&wg->harmonic, loop);
+    float half = delayallpass_read(&wg->harmonic);
+    float output = wg->harmonics ? 0.5f * (loop + half) : loop;
+
+    output = 0.1 * output;
+    wg->dynamic_y_ = (1.f - wg->dynamic_coeff) * output + wg->dynamic_y_ * wg->dynamic_coeff;
+    output = output * wg->velocity + (1.f - wg->velocity) * 1.41421356237 * wg->dynamic_y_;
+
+    return output * wg->velocity;
+}
+
+#endif // WAVEGUIDE_H_INCLUDED
@@ -1,55 +1,126 @@
 #pragma once
 
 #include "GuitarSound.h"
+#include "Trace.h"
 
 #include "DSP/PluckedString.h"
 #include "DSP/Pickup.h"
+#include "DSP/Waveguide.h"
+#include "DSP/SpectralString.h"
 
 #define ENVELOPE_ATTACK_TIME (25.f * 0.001)
 #define ENVELOPE_RELEASE_TIME (200.f * 0.001)
 
-PluckedString *strings[6];
-Pickup *pickups[6];
+#define ENGINE_MODAL 0
+#define ENGINE_WAVEGUIDE 1
+#define ENGINE_SPECTRAL 2
 
-int n = 0;
+// semitones the pitch wheel bends either way
+#define PITCH_BEND_RANGE 2.f
 
 class GuitarVoice : public juce::SynthesiserVoice
 {
     int success;
     int initialized; // check if a note has been played
+    int allocated;
 public:
-    GuitarVoice()
+    // batch, when given, holds mode tables the processor prepared for the block being rendered
+    GuitarVoice (const StringBatch* batch = nullptr) : batch (batch)
     {
+        allocated = 0;
+        engine = ENGINE_MODAL;
+
+        spectral_init(&spectral, getSpectralTables(), (int) getSampleRate() );
+        prepare();
+    }
+
+    // the spectral tables depend on nothing, so every voice of every instance shares the copy built on first use
+    static const SpectralTables* getSpectralTables()
+    {
+        static SpectralTables tables;
+        static const bool built = (spectral_tables_init(&tables), true);
+        juce::ignoreUnused (built);
+        return &tables;
+    }
+
+    ~GuitarVoice()
+    {
+        freeBuffers();
+    }
+
+    // all of the DSP state depends on the sample rate, so it is rebuilt when the rate changes
+    void setCurrentPlaybackSampleRate (double newRate) override
+    {
+        auto previousRate = getSampleRate();
+        juce::SynthesiserVoice::setCurrentPlaybackSampleRate (newRate);
+
+        if (newRate > 0 && newRate != previousRate)
+            prepare();
+    }
+
+    void prepare()
+    {
+        freeBuffers();
+
         gate = 0;
         initialized = 0;
-        if (n > 5) n = 0;
         string_init(&guitar_string, (int) getSampleRate(), 440.f );
         string_noteon(&guitar_string, 1.f);
         string_setfrequency(&guitar_string, 20.f);
 
-        if (pickup_init(&pickup, (int) getSampleRate() ) ) success = 1;
+        string_setspectral(&guitar_string, engine == ENGINE_SPECTRAL);
+
+        spectral_reset(&spectral, (int) getSampleRate() );
+
+        int pickup_success = pickup_init(&pickup, (int) getSampleRate() );
+        int waveguide_success = waveguide_init(&waveguide, (int) getSampleRate() );
+        waveguide_setfrequency(&waveguide, 20.f);
+        allocated = 1;
+
+        if (pickup_success && waveguide_success) success = 1;
         else success = 0;
         pickup_setposition(&pickup, 6.375 / 25.5);
         pickup_setpickup(&pickup, 5000.f, 0.707, PICKUP_PRESET_GUITAR, 1.f);
-        pickups[n] = &pickup;
-        strings[n++] = &guitar_string;
         gain_y_ = 0;
         release = 0;
-        pitch_bend = 0;
+        midi_note = 0;
 
         attack_coeff = powf(0.01, 1.f / ( (float) getSampleRate() * ENVELOPE_ATTACK_TIME) );
         release_coeff = powf(0.01, 1.f / ( (float) getSampleRate() * ENVELOPE_RELEASE_TIME) );
 
-        prev_freq = 0.f;
-        prev_pitchwheel_freq = 0.f;
+        frequency = 0.f;
     }
 
-    ~GuitarVoice()
+    // silences the voice and drops its note in place, hosts may call this on the audio thread so
+    // nothing is allocated, the buffers and tables are kept and only prepare() rebuilds them
+    void reset()
     {
-        pickup_free(&pickup);
-        n = 0;
-        prev_freq = 0.f;
-        prev_pitchwheel_freq = 0.f;
+        clearCurrentNote();
+
+        // the string is left excited as prepare() leaves it, so a reset voice sounds like a new one
+        string_reset(&guitar_string);
+        string_noteon(&guitar_string, 1.f);
+        spectral_reset(&spectral, (int) getSampleRate() );
+        pickup_reset(&pickup);
+        waveguide_reset(&waveguide);
+
+        gate = 0;
+        gain_y_ = 0;
+        release = 0;
+        initialized = 0;
+        midi_note = 0;
+
+        // the next note recomputes its tables and pickup delay even at the frequency the voice last played
+        frequency = 0.f;
+    }
+
+    void freeBuffers()
+    {
+        if (allocated) {
+            pickup_free(&pickup);
+            waveguide_free(&waveguide);
+        }
+        allocated = 0;
     }
 
     bool canPlaySound(juce::SynthesiserSound* sound) override
@@ -57,34 +128,43 @@ public:
         return dynamic_cast<GuitarSound*> (sound) != NULL && success == 1;
     }
 
-    void startNote (int midiNoteNumber, float velocity, juce::SynthesiserSound*, int) override
+    // the processor predicts the frequencies of a block with this, so it must match what the voices play
+    static float getNoteFrequency (int midiNoteNumber, int pitchWheelValue)
     {
-        midi_note = (float) midiNoteNumber;
-        auto cyclesPerSecond = juce::MidiMessage::getMidiNoteInHertz (midiNoteNumber);
+        float bend = (float) (pitchWheelValue - 8192) / (pitchWheelValue > 8192 ? 8191.f : 8192.f) * PITCH_BEND_RANGE;
+        return 440.f * powf(2.f, ((float) midiNoteNumber + bend - 69.f) / 12.f);
+    }
+
+    void startNote (int midiNoteNumber, float velocity, juce::SynthesiserSound*, int currentPitchWheelPosition) override
+    {
+        PHYSIGUITAR_TRACE_SCOPE_ARG ("startNote", midiNoteNumber);
+        midi_note = midiNoteNumber;
+        setFrequency(getNoteFrequency(midi_note, currentPitchWheelPosition) );
         
-        if (prev_freq != cyclesPerSecond) {
-            string_setfrequency(&guitar_string, cyclesPerSecond);
-            pickup_setfrequency(&pickup, cyclesPerSecond);
-            string_update(&guitar_string);
+        if (engine == ENGINE_WAVEGUIDE) {
+            waveguide_noteon(&waveguide, velocity);
+        } else {
+            string_noteon(&guitar_string, velocity);
+            if (engine == ENGINE_SPECTRAL)
+                spectral_noteon(&spectral, &guitar_string);
         }
-        
-        string_noteon(&guitar_string, velocity);
         release = 0;
         gain_y_ = 0;
         initialized = 1;
 
         gate = 1.f;
-        prev_freq = cyclesPerSecond;
     }
 
     void stopNote (float, bool allowTailOff) override
     {
+        PHYSIGUITAR_TRACE_SCOPE ("stopNote");
         release = 1;
         gate = 0.f;
     }
 
     void renderNextBlock (juce::AudioBuffer<float>& outputBuffer, int startSample, int numSamples) override
     {
+        PHYSIGUITAR_TRACE_SCOPE_ARG ("renderNextBlock", numSamples);
         while (--numSamples >= 0)
         {
             if (gate > gain_y_)
@@ -92,7 +172,14 @@ public:
             else
                 gain_y_ = release_coeff * (gain_y_ - gate) + gate;
                 
-            auto currentSample = pickup_process(&pickup, string_process(&guitar_string) ) * gain_y_;
+            float stringSample;
+            if (engine == ENGINE_WAVEGUIDE)
+                stringSample = waveguide_process(&waveguide);
+            else if (engine == ENGINE_SPECTRAL)
+                stringSample = spectral_process(&spectral);
+            else
+                stringSample = string_process(&guitar_string);
+            auto currentSample = pickup_process(&pickup, stringSample) * gain_y_;
             if (!initialized) currentSample = 0;
 
             for (auto i = outputBuffer.getNumChannels(); --i >= 0;)
@@ -112,39 +199,64 @@ public:
 
     void pitchWheelMoved (int newPitchWheelValue) override
     {
-        if (newPitchWheelValue - 8192 > 0)
-            pitch_bend = (float) (newPitchWheelValue - 8192) / 8191.f * 2.f;
+        PHYSIGUITAR_TRACE_SCOPE_ARG ("pitchWheelMoved", newPitchWheelValue);
+        setFrequency(getNoteFrequency(midi_note, newPitchWheelValue) );
+    }
 
-        float frequency = 440.f * powf(2.f, (midi_note + pitch_bend - 69.f) / 12.f);
-        
-        if (prev_pitchwheel_freq != frequency) {
-            pickup_setfrequency(&pickup, frequency);
-            string_setfrequency(&guitar_string, frequency);
-            string_update(&guitar_string);
+    void setFrequency (float newFrequency)
+    {
+        if (frequency != newFrequency) {
+            string_setfrequency(&guitar_string, newFrequency);
+            waveguide_setfrequency(&waveguide, newFrequency);
+            pickup_setfrequency(&pickup, newFrequency);
+            updateEngine();
         }
-        
-        prev_pitchwheel_freq = frequency;
+
+        frequency = newFrequency;
     }
 
     void controllerMoved (int, int) override
     {
     }
 
+    // only the selected engine keeps its tables up to date, the tables follow on the next updateEngine
+    void setEngine (int newEngine)
+    {
+        engine = newEngine;
+        string_setspectral(&guitar_string, engine == ENGINE_SPECTRAL);
+    }
+
+    void updateEngine()
+    {
+        if (engine == ENGINE_WAVEGUIDE) {
+            PHYSIGUITAR_TRACE_SCOPE ("waveguide_update");
+            waveguide_update(&waveguide);
+        } else if (!guitar_string.updated) {
+            PHYSIGUITAR_TRACE_SCOPE ("string_update");
+            string_update_batched(&guitar_string, batch);
+
+            // the spectral engine follows the new mode table
+            if (engine == ENGINE_SPECTRAL)
+                spectral_update(&spectral, &guitar_string);
+        }
+    }
+
     using juce::SynthesiserVoice::renderNextBlock;
 
     PluckedString guitar_string;
+    Waveguide waveguide;
+    SpectralString spectral;
     Pickup pickup;
+    int engine;
+    const StringBatch* batch;
     
     float gain_y_;
     int release;
-    float midi_note;
-    float pitch_bend;
+    int midi_note;
+    float frequency;
 
     float gate;
     
-    float prev_freq;
-    float prev_pitchwheel_freq;
-
     float attack_coeff;
     float release_coeff;
 };
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "GuitarVoice.h"
+#include "Trace.h"
+
+// Mode tables for the frequencies a block will need, computed in one pass before
+// the synth renders it instead of one string_update at a time as each event comes up.
+class NoteBatch
+{
+public:
+    NoteBatch()
+    {
+        reset();
+    }
+
+    // forgets the wheel positions along with the tables
+    void reset()
+    {
+        string_batch_clear(&batch);
+
+        for (auto& value : pitchWheel)
+            value = 8192;
+    }
+
+    void prepare (juce::Synthesiser& synth, const juce::MidiBuffer& midiMessages)
+    {
+        PHYSIGUITAR_TRACE_SCOPE ("batch");
+        string_batch_clear(&batch);
+
+        GuitarVoice* first = nullptr;
+
+        // the notes the wheel can bend and their channels, newest last, at most one per voice since new notes steal the oldest
+        int sounding[128];
+        int channels[128];
+        int count = 0;
+        int voices = juce::jmin(synth.getNumVoices(), 128);
+
+        for (int i = 0; i < synth.getNumVoices(); i++) {
+            auto* voice = dynamic_cast<GuitarVoice*> (synth.getVoice(i) );
+            if (voice == nullptr)
+                continue;
+
+            if (first == nullptr)
+                first = voice;
+
+            if (voice->isVoiceActive() && count < voices) {
+                sounding[count] = voice->getCurrentlyPlayingNote();
+                channels[count] = getChannel(*voice);
+                count++;
+            }
+        }
+
+        // the waveguide has no mode tables, the wheel is still followed for later blocks
+        bool tables = first != nullptr && first->engine != ENGINE_WAVEGUIDE;
+
+        // voices whose settings changed need their current frequency again
+        for (int i = 0; tables && i < synth.getNumVoices(); i++) {
+            auto* voice = dynamic_cast<GuitarVoice*> (synth.getVoice(i) );
+
+            if (voice != nullptr && !voice->guitar_string.updated)
+                string_batch_add(&batch, voice->guitar_string.frequency);
+        }
+
+        // notes keep following the wheel until their release has finished, so none are dropped on note off
+        for (const auto metadata : midiMessages) {
+            auto message = metadata.getMessage();
+            auto channel = (message.getChannel() - 1) & 15;
+
+            if (message.isNoteOn() ) {
+                int note = message.getNoteNumber();
+                int kept = 0;
+
+                // a note played again on its channel takes over the voice that had it
+                for (int i = 0; i < count; i++) {
+                    if (sounding[i] != note || channels[i] != channel) {
+                        sounding[kept] = sounding[i];
+                        channels[kept] = channels[i];
+                        kept++;
+                    }
+                }
+                count = kept;
+
+                if (count == voices && count > 0) {
+                    for (int i = 1; i < count; i++) {
+                        sounding[i - 1] = sounding[i];
+                        channels[i - 1] = channels[i];
+                    }
+                    count--;
+                }
+
+                if (count < voices) {
+                    sounding[count] = note;
+                    channels[count] = channel;
+                    count++;
+                }
+
+                if (tables)
+                    string_batch_add(&batch, GuitarVoice::getNoteFrequency(message.getNoteNumber(), pitchWheel[channel]) );
+            } else if (message.isPitchWheel() ) {
+                pitchWheel[channel] = message.getPitchWheelValue();
+
+                // the synth only bends the voices playing on the wheel's channel
+                for (int i = 0; tables && i < count; i++) {
+                    if (channels[i] == channel)
+                        string_batch_add(&batch, GuitarVoice::getNoteFrequency(sounding[i], pitchWheel[channel]) );
+                }
+            }
+        }
+
+        // every voice has the same settings, so any of them gives the tables
+        if (tables)
+            string_batch_update(&batch, &first->guitar_string);
+    }
+
+    // the tables are only valid while the settings they were computed with are
+    void clear()
+    {
+        string_batch_clear(&batch);
+    }
+
+    StringBatch batch;
+
+private:
+    // zero based like the wheel positions, -1 when the voice is silent
+    static int getChannel (const juce::SynthesiserVoice& voice)
+    {
+        for (int channel = 1; channel <= 16; channel++) {
+            if (voice.isPlayingChannel(channel) )
+                return channel - 1;
+        }
+        return -1;
+    }
+
+    int pitchWheel[16];
+};
@@ -8,17 +8,9 @@
 
 #include "PluginProcessor.h"
 #include "GuitarVoice.h"
-
-float prev_pos = 0.f;
-float prev_decay = 0.f;
-float prev_damping = 0.f;
-float prev_width = 0.f;
-
-float prev_pickuppos = 0.f;
-
-float prev_material = 0;
-short prev_harmonics = -1;
-short prev_quality = -1;
+#include "NoteBatch.h"
+#include "SympatheticResonance.h"
+#include "Trace.h"
 
 //==============================================================================
 PhysiGuitarAudioProcessor::PhysiGuitarAudioProcessor()
@@ -34,30 +26,44 @@ PhysiGuitarAudioProcessor::PhysiGuitarAudioProcessor()
     addParameter(width = new juce::AudioParameterFloat({"pick_width", 1}, "Pick Width", 0.0f, 1.f, 0.5) );
     addParameter(harmonics = new juce::AudioParameterBool({"harmonics", 1}, "Natural Harmonics", false) );
     addParameter(quality = new juce::AudioParameterBool({"quality", 1}, "High Quality Mode", false) );
-    prev_pos = 0.f;
-    prev_decay = 0.f;
-    prev_damping = 0.f;
-    prev_width = 0.f;
+    addParameter(engine = new juce::AudioParameterChoice({"engine", 1}, "String Engine", {"Modal", "Waveguide", "Spectral"}, ENGINE_MODAL) );
+    addParameter(sympathetic = new juce::AudioParameterFloat({"sympathetic", 1}, "Sympathetic Resonance", 0.0f, 1.f, 0.f) );
 
-    prev_pickuppos = 0.f;
+    notes = std::make_unique<NoteBatch>();
 
-    prev_material = 0;
-    prev_harmonics = -1;
-    prev_quality = -1;
+    // every instance owns its voices, nothing in the render path is shared between instances
+    for (int i = 0; i < 6; i++)
+        synth.addVoice(new GuitarVoice(&notes->batch) );
+
+    synth.addSound(new GuitarSound());
+    // events land on their own sample, so splitting a block into sub-blocks cannot move them
+    synth.setMinimumRenderingSubdivisionSize(1, true);
+
+    resonance = std::make_unique<SympatheticResonance>();
+
+    invalidateParameters();
 }
 
 PhysiGuitarAudioProcessor::~PhysiGuitarAudioProcessor()
 {
-    prev_pos = 0.f;
-    prev_decay = 0.f;
-    prev_damping = 0.f;
-    prev_width = 0.f;
+    dumpTrace();
+}
+
+void PhysiGuitarAudioProcessor::invalidateParameters()
+{
+    // none of the parameters can take these values, so the next block pushes all of them to the voices
+    prev_pos = -1.f;
+    prev_decay = -1.f;
+    prev_damping = -1.f;
+    prev_width = -1.f;
 
-    prev_pickuppos = 0.f;
+    prev_pickuppos = -1.f;
 
-    prev_material = 0;
+    prev_material = -1.f;
     prev_harmonics = -1;
     prev_quality = -1;
+    prev_engine = -1;
+    prev_sympathetic = -1.f;
 }
 
 //==============================================================================
@@ -125,17 +131,47 @@ void PhysiGuitarAudioProcessor::changeProgramName (int index, const juce::String
 //==============================================================================
 void PhysiGuitarAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
+    // rebuilds the voices' DSP state when the rate changes
     synth.setCurrentPlaybackSampleRate(sampleRate);
-    for (int i = 0; i < 6; i++)
-        synth.addVoice(new GuitarVoice());
-    
-    synth.addSound(new GuitarSound());
+    resonance->prepare(sampleRate);
+    slice.ensureSize(4096);
+    invalidateParameters();
+
+    // the audio thread's first trace event takes a ring readied here
+    PHYSIGUITAR_TRACE_WARM_UP();
 }
 
 void PhysiGuitarAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
+    dumpTrace();
+}
+
+void PhysiGuitarAudioProcessor::reset()
+{
+    // drops every note and tail but keeps the voices, so an instance can be reused for an unrelated render
+    for (int channel = 1; channel <= 16; channel++) {
+        synth.handleSustainPedal(channel, false);
+        synth.handleSostenutoPedal(channel, false);
+        synth.handlePitchWheel(channel, 8192);
+    }
+
+    for (int i = 0; i < synth.getNumVoices(); i++) {
+        if (auto* voice = dynamic_cast<GuitarVoice*> (synth.getVoice(i) ) )
+            voice->reset();
+    }
+
+    notes->reset();
+    resonance->prepare(getSampleRate() );
+    invalidateParameters();
+}
+
+void PhysiGuitarAudioProcessor::dumpTrace()
+{
+    // no-op unless built with PHYSIGUITAR_TRACE=1, see Trace.h
+    PHYSIGUITAR_TRACE_DUMP (juce::File::getSpecialLocation (juce::File::tempDirectory)
+                                .getChildFile ("PhysiGuitar.trace.json").getFullPathName().toRawUTF8());
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -164,9 +200,93 @@ bool PhysiGuitarAudioProcessor::isBusesLayoutSupported (const BusesLayout& layou
 }
 #endif
 
+void PhysiGuitarAudioProcessor::updateParameters()
+{
+    PHYSIGUITAR_TRACE_SCOPE ("parameters");
+
+    for (int i = 0; i < synth.getNumVoices(); i++) {
+        auto* voice = dynamic_cast<GuitarVoice*> (synth.getVoice(i) );
+        if (voice == nullptr)
+            continue;
+
+        PluckedString *string = &voice->guitar_string;
+        Waveguide *waveguide = &voice->waveguide;
+        Pickup *pickup = &voice->pickup;
+
+        if (prev_pos != *pluck_position) {
+            string_setposition(string, *pluck_position);
+            waveguide_setposition(waveguide, *pluck_position);
+        }
+        if (prev_decay != *decay) {
+            string_setdecay(string, *decay);
+            waveguide_setdecay(waveguide, *decay);
+        }
+        if (prev_damping != *damping) {
+            string_setdamping(string, *damping);
+            waveguide_setdamping(waveguide, *damping);
+        }
+        if (prev_width != *width) {
+            string_setwidth(string, *width);
+            waveguide_setwidth(waveguide, *width);
+        }
+            
+        if (*harmonics != prev_harmonics) {
+            string_setharmonics(string, *harmonics);
+            waveguide_setharmonics(waveguide, *harmonics);
+        }
+               
+        if (*material != prev_material) {
+            string_setmaterial(string, *material);
+            waveguide_setmaterial(waveguide, *material);
+        }
+            
+        if (*quality != prev_quality) {
+            string_sethq(string, *quality);
+            waveguide_sethq(waveguide, *quality);
+        }
+        
+        if (*pickup_position != prev_pickuppos)
+            pickup_setposition(pickup, *pickup_position);
+            
+        if (*bass)
+            pickup_setpickup(pickup, 5000.f, 0.707, PICKUP_PRESET_BASS, *tone);
+        else
+            pickup_setpickup(pickup, 5000.f, 0.707, PICKUP_PRESET_GUITAR, *tone);
+
+        if (*engine != prev_engine)
+            voice->setEngine(*engine);
+    }
+
+    Sympathetic *bank = &resonance->bank;
+
+    if (prev_decay != *decay)
+        sympathetic_setdecay(bank, *decay);
+    if (prev_damping != *damping)
+        sympathetic_setdamping(bank, *damping);
+    if (*material != prev_material)
+        sympathetic_setmaterial(bank, *material);
+    if (*sympathetic != prev_sympathetic)
+        sympathetic_setamount(bank, *sympathetic);
+
+    sympathetic_update(bank);
+    
+    prev_pos = *pluck_position;
+    prev_decay = *decay;
+    prev_damping = *damping;
+    prev_width = *width;
+    prev_harmonics = *harmonics;
+    prev_pickuppos = *pickup_position;
+    
+    prev_material = *material;
+    prev_quality = *quality;
+    prev_engine = *engine;
+    prev_sympathetic = *sympathetic;
+}
+
 void PhysiGuitarAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
     auto numSamples = buffer.getNumSamples();
+    PHYSIGUITAR_TRACE_SCOPE_ARG ("processBlock", numSamples);
     juce::ScopedNoDenormals noDenormals;
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
@@ -187,47 +307,33 @@ void PhysiGuitarAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
     // Alternatively, you can process the samples with the channels
     // interleaved by keeping the same state.
     
-    for (int i = 0; i < 6; i++) {
-        if (prev_pos != *pluck_position)
-            string_setposition(strings[i], *pluck_position);
-        if (prev_decay != *decay)
-            string_setdecay(strings[i], *decay);
-        if (prev_damping != *damping)
-            string_setdamping(strings[i], *damping);
-        if (prev_width != *width)
-            string_setwidth(strings[i], *width);
-            
-        if (*harmonics != prev_harmonics)
-            string_setharmonics(strings[i], *harmonics);
-               
-        if (*material != prev_material)
-            string_setmaterial(strings[i], *material);
-            
-        if (*quality != prev_quality)
-            string_sethq(strings[i], *quality);
-      
-        string_update(strings[i]);
-        
-        if (*pickup_position != prev_pickuppos)
-            pickup_setposition(pickups[i], *pickup_position);
-            
-        if (*bass)
-            pickup_setpickup(pickups[i], 5000.f, 0.707, PICKUP_PRESET_BASS, *tone);
-        else
-            pickup_setpickup(pickups[i], 5000.f, 0.707, PICKUP_PRESET_GUITAR, *tone);
+    updateParameters();
+
+    // the mode tables the block's settings, notes and pitch bends need are computed together up front
+    notes->prepare(synth, midiMessages);
+
+    for (int i = 0; i < synth.getNumVoices(); i++) {
+        if (auto* voice = dynamic_cast<GuitarVoice*> (synth.getVoice(i) ) )
+            voice->updateEngine();
     }
-    
-    prev_pos = *pluck_position;
-    prev_decay = *decay;
-    prev_damping = *damping;
-    prev_width = *width;
-    prev_harmonics = *harmonics;
-    prev_pickuppos = *pickup_position;
-    
-    prev_material = *material;
-    prev_quality = *quality;
-    
-    synth.renderNextBlock(buffer, midiMessages, 0, numSamples);
+
+    // the open strings pick up the voices' modes between sub-blocks of the control size,
+    // they keep rendering after being switched off until they have died out
+    if (*sympathetic > 0.f || resonance->isActive()) {
+        for (int start = 0; start < numSamples; start += SYMPATHETIC_CONTROL_SIZE) {
+            auto length = juce::jmin(SYMPATHETIC_CONTROL_SIZE, numSamples - start);
+
+            slice.clear();
+            slice.addEvents(midiMessages, start, length, 0);
+
+            synth.renderNextBlock(buffer, slice, start, length);
+            resonance->renderNextBlock(buffer, start, length);
+            resonance->couple(synth);
+        }
+    } else
+        synth.renderNextBlock(buffer, midiMessages, 0, numSamples);
+
+    notes->clear();
 }
 
 //==============================================================================
@@ -257,6 +363,8 @@ void PhysiGuitarAudioProcessor::getStateInformation (juce::MemoryBlock& destData
     stream.writeBool(*bass);
     stream.writeBool(*harmonics);
     stream.writeBool(*quality);
+    stream.writeInt(*engine);
+    stream.writeFloat(*sympathetic);
 }
 
 void PhysiGuitarAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
@@ -274,6 +382,8 @@ void PhysiGuitarAudioProcessor::setStateInformation (const void* data, int sizeI
     bass->setValueNotifyingHost(stream.readBool() );
     harmonics->setValueNotifyingHost(stream.readBool() );
     quality->setValueNotifyingHost(stream.readBool() );
+    engine->setValueNotifyingHost(engine->convertTo0to1( (float) stream.readInt() ) );
+    sympathetic->setValueNotifyingHost(stream.readFloat() );
 
 }
 
@@ -10,6 +10,9 @@
 
 #include <JuceHeader.h>
 
+class SympatheticResonance;
+class NoteBatch;
+
 //==============================================================================
 /**
 */
@@ -23,6 +26,7 @@ public:
     //==============================================================================
     void prepareToPlay (double sampleRate, int samplesPerBlock) override;
     void releaseResources() override;
+    void reset() override;
 
    #ifndef JucePlugin_PreferredChannelConfigurations
     bool isBusesLayoutSupported (const BusesLayout& layouts) const override;
@@ -54,11 +58,20 @@ public:
     void setStateInformation (const void* data, int sizeInBytes) override;
 
 private:
+    void invalidateParameters();
+    void updateParameters();
+    void dumpTrace();
+
     juce::Synthesiser synth;
+    // the events of one sub-block, the synth would otherwise handle the rest of the block's events too
+    juce::MidiBuffer slice;
+    std::unique_ptr<SympatheticResonance> resonance;
+    std::unique_ptr<NoteBatch> notes;
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (PhysiGuitarAudioProcessor)
-    juce::AudioParameterFloat *pluck_position, *decay, *damping, *pickup_position, *tone, *width, *material;
+    juce::AudioParameterFloat *pluck_position, *decay, *damping, *pickup_position, *tone, *width, *material, *sympathetic;
     juce::AudioParameterBool *bass, *harmonics, *quality;
+    juce::AudioParameterChoice *engine;
     
     float prev_pos;
     float prev_decay;
@@ -70,4 +83,6 @@ private:
     float prev_material;
     short prev_harmonics;
     short prev_quality;
+    int prev_engine;
+    float prev_sympathetic;
 };
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "GuitarVoice.h"
+#include "Trace.h"
+
+#include "DSP/Sympathetic.h"
+
+// Open strings ringing along with the synth's voices, see DSP/Sympathetic.h
+class SympatheticResonance
+{
+public:
+    SympatheticResonance()
+    {
+        prepare(44100.0);
+    }
+
+    void prepare (double sampleRate)
+    {
+        sympathetic_init(&bank, (unsigned long) sampleRate);
+    }
+
+    bool isActive() const
+    {
+        return bank.active != 0;
+    }
+
+    void renderNextBlock (juce::AudioBuffer<float>& outputBuffer, int startSample, int numSamples)
+    {
+        PHYSIGUITAR_TRACE_SCOPE_ARG ("sympathetic", numSamples);
+        if (!bank.active)
+            return;
+
+        while (--numSamples >= 0)
+        {
+            auto currentSample = sympathetic_process(&bank);
+
+            for (auto i = outputBuffer.getNumChannels(); --i >= 0;)
+                outputBuffer.addSample (i, startSample, currentSample);
+
+            ++startSample;
+        }
+    }
+
+    // only sounding voices of the modal engine have mode state to pass on
+    void couple (juce::Synthesiser& synth)
+    {
+        sympathetic_control(&bank);
+
+        for (int i = 0; i < synth.getNumVoices(); i++) {
+            auto* voice = dynamic_cast<GuitarVoice*> (synth.getVoice(i) );
+
+            if (voice != nullptr && voice->isVoiceActive() && voice->engine == ENGINE_MODAL)
+                sympathetic_couple(&bank, i, &voice->guitar_string, voice->gain_y_);
+            else
+                sympathetic_couple(&bank, i, NULL, 0.f);
+        }
+    }
+
+    Sympathetic bank;
+};
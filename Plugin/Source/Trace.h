@@ -0,0 +1,222 @@
+#pragma once
+
+// Opt-in tracing of the render pipeline.
+//
+// Build with PHYSIGUITAR_TRACE=1 in the exporter's preprocessor definitions to
+// record trace points, otherwise every macro below expands to nothing.
+// Each thread writes into its own fixed size ring buffer. PHYSIGUITAR_TRACE_WARM_UP
+// allocates and faults in rings ahead of the threads that will claim them, so
+// once it has run a thread's first event only takes a spare ring and recording
+// never locks or allocates on the audio thread. PHYSIGUITAR_TRACE_DUMP writes
+// everything recorded so far as Chrome trace JSON (open with chrome://tracing
+// or https://ui.perfetto.dev).
+
+#ifndef PHYSIGUITAR_TRACE
+#define PHYSIGUITAR_TRACE 0
+#endif
+
+#if PHYSIGUITAR_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// events kept per thread, must be a power of two
+#ifndef PHYSIGUITAR_TRACE_RING_SIZE
+#define PHYSIGUITAR_TRACE_RING_SIZE 65536
+#endif
+
+// rings kept ready for threads that have not logged anything yet
+#ifndef PHYSIGUITAR_TRACE_SPARE_RINGS
+#define PHYSIGUITAR_TRACE_SPARE_RINGS 4
+#endif
+
+// threads past this many record nothing
+#define PHYSIGUITAR_TRACE_MAX_RINGS 256
+
+namespace physiguitar_trace
+{
+    struct Event
+    {
+        const char* name;
+        int64_t start;
+        int64_t duration;
+        int arg;
+    };
+
+    struct Ring
+    {
+        Event events[PHYSIGUITAR_TRACE_RING_SIZE];
+        std::atomic<uint32_t> head { 0 };
+    };
+
+    // slot i is the ring of the i-th thread to log, threads claim slots without locking
+    struct Registry
+    {
+        std::mutex lock;
+        std::vector<std::unique_ptr<Ring>> owned;
+        std::atomic<Ring*> rings[PHYSIGUITAR_TRACE_MAX_RINGS] {};
+        std::atomic<int> claimed { 0 };
+    };
+
+    inline Registry& registry()
+    {
+        static Registry instance;
+        return instance;
+    }
+
+    inline int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds> (
+            std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+
+    // rings are value-initialised, so every page is written and faulted in here rather
+    // than on the first events, call with the registry locked
+    inline Ring* allocateRing (Registry& reg, int slot)
+    {
+        auto* ring = reg.rings[slot].load (std::memory_order_acquire);
+
+        if (ring == nullptr)
+        {
+            reg.owned.push_back (std::make_unique<Ring>());
+            ring = reg.owned.back().get();
+            reg.rings[slot].store (ring, std::memory_order_release);
+        }
+
+        return ring;
+    }
+
+    // rings are never freed so a dump stays valid after their threads exit, a thread that
+    // finds no spare ring, because nothing warmed them up, allocates its own as a fallback
+    inline Ring* threadRing()
+    {
+        thread_local Ring* ring = nullptr;
+        thread_local bool claimed = false;
+
+        if (! claimed)
+        {
+            auto& reg = registry();
+            int slot = reg.claimed.fetch_add (1, std::memory_order_relaxed);
+            claimed = true;
+
+            if (slot < PHYSIGUITAR_TRACE_MAX_RINGS)
+            {
+                ring = reg.rings[slot].load (std::memory_order_acquire);
+
+                if (ring == nullptr)
+                {
+                    std::lock_guard<std::mutex> guard (reg.lock);
+                    ring = allocateRing (reg, slot);
+                }
+            }
+        }
+
+        return ring;
+    }
+
+    // claims the calling thread's ring and readies spare ones for the threads still to log,
+    // call it off the audio thread before rendering, e.g. from prepareToPlay
+    inline void warmUp()
+    {
+        threadRing();
+
+        auto& reg = registry();
+        std::lock_guard<std::mutex> guard (reg.lock);
+        int first = reg.claimed.load (std::memory_order_relaxed);
+
+        for (int slot = first; slot < first + PHYSIGUITAR_TRACE_SPARE_RINGS && slot < PHYSIGUITAR_TRACE_MAX_RINGS; slot++)
+            allocateRing (reg, slot);
+    }
+
+    inline void record (const char* name, int64_t start, int64_t end, int arg)
+    {
+        auto* ring = threadRing();
+        if (ring == nullptr)
+            return;
+
+        auto index = ring->head.load (std::memory_order_relaxed);
+
+        ring->events[index & (PHYSIGUITAR_TRACE_RING_SIZE - 1)] = { name, start, end - start, arg };
+        ring->head.store (index + 1, std::memory_order_release);
+    }
+
+    class Scope
+    {
+    public:
+        Scope (const char* name, int arg = -1) : name (name), arg (arg), start (now()) {}
+        ~Scope() { record (name, start, now(), arg); }
+
+    private:
+        const char* name;
+        int arg;
+        int64_t start;
+    };
+
+    // Events a writer overwrites while the dump is running may come out torn,
+    // so dump once rendering has stopped (e.g. from releaseResources).
+    inline bool dump (const char* path)
+    {
+        FILE* file = std::fopen (path, "w");
+        if (file == nullptr)
+            return false;
+
+        std::fprintf (file, "{\"traceEvents\":[\n");
+
+        auto& reg = registry();
+        std::lock_guard<std::mutex> guard (reg.lock);
+        int claimed = reg.claimed.load (std::memory_order_relaxed);
+        bool first = true;
+
+        for (int slot = 0; slot < claimed && slot < PHYSIGUITAR_TRACE_MAX_RINGS; slot++)
+        {
+            auto* ring = reg.rings[slot].load (std::memory_order_acquire);
+            if (ring == nullptr)
+                continue;
+
+            uint32_t head = ring->head.load (std::memory_order_acquire);
+            uint32_t count = head < PHYSIGUITAR_TRACE_RING_SIZE ? head : PHYSIGUITAR_TRACE_RING_SIZE;
+
+            for (uint32_t i = head - count; i != head; i++)
+            {
+                const Event& event = ring->events[i & (PHYSIGUITAR_TRACE_RING_SIZE - 1)];
+
+                std::fprintf (file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                              first ? "" : ",\n", event.name, slot + 1,
+                              (double) event.start * 0.001, (double) event.duration * 0.001);
+
+                if (event.arg >= 0)
+                    std::fprintf (file, ",\"args\":{\"value\":%d}", event.arg);
+
+                std::fprintf (file, "}");
+                first = false;
+            }
+        }
+
+        std::fprintf (file, "\n]}\n");
+        return std::fclose (file) == 0;
+    }
+}
+
+#define PHYSIGUITAR_TRACE_CONCAT_(a, b) a##b
+#define PHYSIGUITAR_TRACE_CONCAT(a, b) PHYSIGUITAR_TRACE_CONCAT_(a, b)
+
+#define PHYSIGUITAR_TRACE_SCOPE(name) \
+    physiguitar_trace::Scope PHYSIGUITAR_TRACE_CONCAT(trace_scope_, __LINE__) (name)
+#define PHYSIGUITAR_TRACE_SCOPE_ARG(name, arg) \
+    physiguitar_trace::Scope PHYSIGUITAR_TRACE_CONCAT(trace_scope_, __LINE__) (name, (int) (arg))
+#define PHYSIGUITAR_TRACE_DUMP(path) physiguitar_trace::dump (path)
+#define PHYSIGUITAR_TRACE_WARM_UP() physiguitar_trace::warmUp()
+
+#else
+
+#define PHYSIGUITAR_TRACE_SCOPE(name)
+#define PHYSIGUITAR_TRACE_SCOPE_ARG(name, arg)
+#define PHYSIGUITAR_TRACE_DUMP(path)
+#define PHYSIGUITAR_TRACE_WARM_UP()
+
+#endif // PHYSIGUITAR_TRACE
@@ -0,0 +1,743 @@
+/*
+  ==============================================================================
+
+    Headless render service for PhysiGuitar.
+
+    Listens on a Unix domain socket and renders any number of sessions on a
+    pool of worker threads. The processors outlive the sessions that use
+    them, so a job only pays for its own samples and not for building a
+    processor, its voices and their tables.
+
+    One command per line, the reply is one line too:
+
+      open <rate> <block size> <slots>    ok <shared memory name> <bytes>
+      midi <sample> <hex bytes>           no reply
+      param <sample> <id> <value>         no reply
+      render <blocks>                     rendered <first slot> <blocks> <position>
+      reset                               ok
+      close                               closes the connection
+
+    Any command may instead be answered with error <reason>. Samples count
+    from the open or the last reset, a MIDI event for a sample that was
+    already rendered plays at the start of the next block. Parameters are
+    addressed by their ID, take normalised values and change at the start of
+    the block holding their sample, as they would from a host. reset starts
+    a new job on the same session, as if it had just been opened.
+
+    Blocks are rendered in place into a POSIX shared memory ring of <slots>
+    blocks, each holding <block size> floats of the left channel followed by
+    as many of the right. A render covers at most <slots> blocks, starting at
+    <first slot> and wrapping around, and overwrites the blocks of the
+    previous render, so the client maps the ring once after open and reads
+    each render before asking for the next one.
+
+    Usage: PhysiGuitarRenderDaemon [--socket /tmp/physiguitar.sock] [--workers 4]
+                                   [--warm 4] [--rate 48000] [--block 128]
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Plugin/Source/PluginProcessor.h"
+#include "Plugin/Source/Trace.h"
+
+#define NUM_CHANNELS 2
+#define MAX_BLOCK_SIZE 8192
+#define MAX_SLOTS 4096
+// a client that sends this much without a newline is not speaking the protocol
+#define MAX_LINE_LENGTH 4096
+
+static volatile std::sig_atomic_t running = 1;
+
+static void stop (int)
+{
+    running = 0;
+}
+
+//==============================================================================
+// Processors kept across sessions, a session gets one that last ran at its rate when there is one
+class ProcessorPool
+{
+public:
+    std::unique_ptr<PhysiGuitarAudioProcessor> acquire (double sampleRate, int blockSize)
+    {
+        std::unique_ptr<PhysiGuitarAudioProcessor> processor;
+
+        {
+            std::lock_guard<std::mutex> guard (lock);
+
+            for (auto it = idle.begin(); it != idle.end(); ++it)
+            {
+                if ((*it)->getSampleRate() == sampleRate)
+                {
+                    processor = std::move (*it);
+                    idle.erase (it);
+                    break;
+                }
+            }
+
+            if (processor == nullptr && ! idle.empty())
+            {
+                processor = std::move (idle.back());
+                idle.pop_back();
+            }
+        }
+
+        if (processor == nullptr)
+            processor = std::make_unique<PhysiGuitarAudioProcessor>();
+
+        // the voices only rebuild their state when the rate changes
+        processor->setRateAndBufferSizeDetails (sampleRate, blockSize);
+        processor->prepareToPlay (sampleRate, blockSize);
+        restart (*processor);
+
+        return processor;
+    }
+
+    void release (std::unique_ptr<PhysiGuitarAudioProcessor> processor)
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        idle.push_back (std::move (processor));
+    }
+
+    // builds the processors up front so the first sessions do not wait for them either
+    void warm (int count, double sampleRate, int blockSize)
+    {
+        std::vector<std::unique_ptr<PhysiGuitarAudioProcessor>> processors;
+
+        for (int i = 0; i < count; i++)
+            processors.push_back (acquire (sampleRate, blockSize));
+
+        for (auto& processor : processors)
+            release (std::move (processor));
+    }
+
+    // back to how a new instance sounds
+    static void restart (PhysiGuitarAudioProcessor& processor)
+    {
+        for (auto* parameter : processor.getParameters())
+            parameter->setValueNotifyingHost (parameter->getDefaultValue());
+
+        processor.reset();
+    }
+
+private:
+    std::mutex lock;
+    std::vector<std::unique_ptr<PhysiGuitarAudioProcessor>> idle;
+};
+
+//==============================================================================
+struct Event
+{
+    juce::int64 time;
+    juce::MidiMessage message;
+};
+
+struct ParameterChange
+{
+    juce::int64 time;
+    juce::AudioProcessorParameter* parameter;
+    float value;
+};
+
+struct Session
+{
+    int socket = -1;
+    int id = 0;
+    std::string input;
+
+    // the command handed to a worker, the main thread leaves a busy session alone
+    std::string job;
+    bool busy = false;
+    bool closing = false;
+
+    std::unique_ptr<PhysiGuitarAudioProcessor> processor;
+    int blockSize = 0;
+    int slots = 0;
+
+    std::string sharedName;
+    float* shared = nullptr;
+    size_t sharedBytes = 0;
+
+    // both sorted by time, events with the same time keep the order they arrived in
+    std::vector<Event> events;
+    std::vector<ParameterChange> changes;
+    juce::int64 position = 0;
+    int slot = 0;
+};
+
+static bool mapShared (Session& session)
+{
+    session.sharedName = "/physiguitar-" + std::to_string (getpid()) + "-" + std::to_string (session.id);
+    session.sharedBytes = (size_t) session.slots * NUM_CHANNELS * (size_t) session.blockSize * sizeof (float);
+
+    int fd = shm_open (session.sharedName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return false;
+
+    void* memory = MAP_FAILED;
+    if (ftruncate (fd, (off_t) session.sharedBytes) == 0)
+        memory = mmap (nullptr, session.sharedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+
+    if (memory == MAP_FAILED)
+    {
+        shm_unlink (session.sharedName.c_str());
+        return false;
+    }
+
+    session.shared = (float*) memory;
+    return true;
+}
+
+static void unmapShared (Session& session)
+{
+    if (session.shared == nullptr)
+        return;
+
+    munmap (session.shared, session.sharedBytes);
+    shm_unlink (session.sharedName.c_str());
+    session.shared = nullptr;
+}
+
+static juce::AudioProcessorParameter* findParameter (juce::AudioProcessor& processor, const std::string& id)
+{
+    for (auto* parameter : processor.getParameters())
+        if (auto* withID = dynamic_cast<juce::AudioProcessorParameterWithID*> (parameter))
+            if (withID->paramID == id.c_str())
+                return parameter;
+
+    return nullptr;
+}
+
+// short messages only, system exclusive would need a length on the line
+static bool parseMidi (std::istringstream& stream, juce::MidiMessage& message)
+{
+    juce::uint8 bytes[3];
+    int size = 0;
+    unsigned int value;
+
+    while (size < 3 && stream >> std::hex >> value)
+    {
+        if (value > 0xff)
+            return false;
+
+        bytes[size++] = (juce::uint8) value;
+    }
+
+    if (size == 0 || bytes[0] < 0x80 || bytes[0] == 0xf0 || bytes[0] == 0xf7
+         || size != juce::MidiMessage::getMessageLengthFromFirstByte (bytes[0]))
+        return false;
+
+    for (int i = 1; i < size; i++)
+        if (bytes[i] >= 0x80)
+            return false;
+
+    message = juce::MidiMessage (bytes, size);
+    return true;
+}
+
+static void clearJob (Session& session)
+{
+    session.events.clear();
+    session.changes.clear();
+    session.position = 0;
+    session.slot = 0;
+}
+
+//==============================================================================
+static std::string render (Session& session, int numBlocks)
+{
+    PHYSIGUITAR_TRACE_SCOPE_ARG ("render job", numBlocks);
+    juce::MidiBuffer midi;
+    size_t nextEvent = 0;
+    size_t nextChange = 0;
+    int first = session.slot;
+
+    for (int block = 0; block < numBlocks; block++)
+    {
+        auto end = session.position + session.blockSize;
+
+        for (; nextChange < session.changes.size() && session.changes[nextChange].time < end; nextChange++)
+            session.changes[nextChange].parameter->setValueNotifyingHost (session.changes[nextChange].value);
+
+        midi.clear();
+        for (; nextEvent < session.events.size() && session.events[nextEvent].time < end; nextEvent++)
+        {
+            auto& event = session.events[nextEvent];
+            midi.addEvent (event.message, (int) juce::jmax ((juce::int64) 0, event.time - session.position));
+        }
+
+        // the processor writes straight into the client's ring
+        float* channels[NUM_CHANNELS];
+        for (int channel = 0; channel < NUM_CHANNELS; channel++)
+            channels[channel] = session.shared + ((size_t) session.slot * NUM_CHANNELS + (size_t) channel) * (size_t) session.blockSize;
+
+        juce::AudioBuffer<float> buffer (channels, NUM_CHANNELS, session.blockSize);
+        buffer.clear();
+        session.processor->processBlock (buffer, midi);
+
+        session.position = end;
+        session.slot = (session.slot + 1) % session.slots;
+    }
+
+    session.events.erase (session.events.begin(), session.events.begin() + (std::ptrdiff_t) nextEvent);
+    session.changes.erase (session.changes.begin(), session.changes.begin() + (std::ptrdiff_t) nextChange);
+
+    return "rendered " + std::to_string (first) + " " + std::to_string (numBlocks) + " " + std::to_string (session.position);
+}
+
+//==============================================================================
+// One thread polls the socket and every idle session, open, reset and render run on the workers
+class Server
+{
+public:
+    Server (ProcessorPool& pool, const std::string& path, int numWorkers)
+        : pool (pool), path (path), numWorkers (numWorkers)
+    {
+    }
+
+    ~Server()
+    {
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            stopping = true;
+        }
+        wakeWorkers.notify_all();
+
+        for (auto& worker : workers)
+            worker.join();
+
+        for (auto& entry : sessions)
+            closeSession (*entry.second);
+
+        if (listener >= 0)
+        {
+            close (listener);
+            unlink (path.c_str());
+        }
+
+        for (auto fd : wake)
+            if (fd >= 0)
+                close (fd);
+    }
+
+    std::string start()
+    {
+        sockaddr_un address {};
+        address.sun_family = AF_UNIX;
+
+        if (path.size() >= sizeof (address.sun_path))
+            return "socket path is too long";
+
+        std::strncpy (address.sun_path, path.c_str(), sizeof (address.sun_path) - 1);
+
+        listener = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0)
+            return std::strerror (errno);
+
+        // a socket file nobody listens on is left over from a daemon that did not exit cleanly
+        if (connect (listener, (sockaddr*) &address, sizeof (address)) == 0)
+        {
+            close (listener);
+            listener = -1;
+            return "another daemon is listening on " + path;
+        }
+
+        close (listener);
+        unlink (path.c_str());
+
+        listener = socket (AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || bind (listener, (sockaddr*) &address, sizeof (address)) != 0 || listen (listener, 64) != 0)
+            return std::strerror (errno);
+
+        if (pipe (wake) != 0)
+            return std::strerror (errno);
+
+        fcntl (wake[0], F_SETFL, O_NONBLOCK);
+
+        for (int i = 0; i < numWorkers; i++)
+            workers.emplace_back ([this] { work(); });
+
+        return {};
+    }
+
+    void run()
+    {
+        while (running)
+        {
+            std::vector<pollfd> fds { { listener, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+            std::vector<Session*> polled;
+
+            for (auto& entry : sessions)
+            {
+                if (! entry.second->busy)
+                {
+                    fds.push_back ({ entry.second->socket, POLLIN, 0 });
+                    polled.push_back (entry.second.get());
+                }
+            }
+
+            if (poll (fds.data(), (nfds_t) fds.size(), 500) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::fprintf (stderr, "poll failed: %s\n", std::strerror (errno));
+                break;
+            }
+
+            if (fds[1].revents & POLLIN)
+                finishJobs();
+
+            if (fds[0].revents & POLLIN)
+                acceptSession();
+
+            for (size_t i = 0; i < polled.size(); i++)
+                if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+                    receive (*polled[i]);
+
+            for (auto it = sessions.begin(); it != sessions.end();)
+            {
+                if (it->second->closing && ! it->second->busy)
+                {
+                    closeSession (*it->second);
+                    it = sessions.erase (it);
+                }
+                else
+                    ++it;
+            }
+        }
+    }
+
+private:
+    void acceptSession()
+    {
+        int fd = accept (listener, nullptr, nullptr);
+        if (fd < 0)
+            return;
+
+        auto session = std::make_unique<Session>();
+        session->socket = fd;
+        session->id = ++lastSessionId;
+        sessions[session->id] = std::move (session);
+    }
+
+    void closeSession (Session& session)
+    {
+        unmapShared (session);
+
+        if (session.processor != nullptr)
+            pool.release (std::move (session.processor));
+
+        close (session.socket);
+    }
+
+    static void reply (Session& session, const std::string& line)
+    {
+        auto text = line + "\n";
+        size_t written = 0;
+
+        while (written < text.size())
+        {
+            auto result = write (session.socket, text.data() + written, text.size() - written);
+
+            if (result < 0 && errno == EINTR)
+                continue;
+
+            // the client went away, the main thread notices when it reads from the socket
+            if (result <= 0)
+                return;
+
+            written += (size_t) result;
+        }
+    }
+
+    void receive (Session& session)
+    {
+        char buffer[4096];
+        auto size = read (session.socket, buffer, sizeof (buffer));
+
+        if (size <= 0)
+        {
+            session.closing = true;
+            return;
+        }
+
+        session.input.append (buffer, (size_t) size);
+        runCommands (session);
+    }
+
+    void runCommands (Session& session)
+    {
+        while (! session.busy && ! session.closing)
+        {
+            auto end = session.input.find ('\n');
+
+            if (end == std::string::npos)
+            {
+                if (session.input.size() > MAX_LINE_LENGTH)
+                {
+                    reply (session, "error line too long");
+                    session.closing = true;
+                }
+                return;
+            }
+
+            auto line = session.input.substr (0, end);
+            session.input.erase (0, end + 1);
+
+            if (! line.empty() && line.back() == '\r')
+                line.pop_back();
+
+            if (! line.empty())
+                runCommand (session, line);
+        }
+    }
+
+    // events are only queued here, anything that touches the processor goes to a worker
+    void runCommand (Session& session, const std::string& line)
+    {
+        std::istringstream stream (line);
+        std::string command;
+        stream >> command;
+
+        if (command == "open" || command == "render" || command == "reset")
+        {
+            session.job = line;
+            session.busy = true;
+
+            {
+                std::lock_guard<std::mutex> guard (lock);
+                jobs.push_back (&session);
+            }
+            wakeWorkers.notify_one();
+        }
+        else if (command == "close")
+        {
+            session.closing = true;
+        }
+        else if (session.processor == nullptr)
+        {
+            reply (session, "error no open session");
+        }
+        else if (command == "midi")
+        {
+            Event event;
+
+            if (! (stream >> event.time) || ! parseMidi (stream, event.message))
+                return reply (session, "error bad midi event");
+
+            auto at = std::upper_bound (session.events.begin(), session.events.end(), event.time,
+                                        [] (juce::int64 time, const Event& other) { return time < other.time; });
+            session.events.insert (at, event);
+        }
+        else if (command == "param")
+        {
+            ParameterChange change;
+            std::string id;
+
+            if (! (stream >> change.time >> id >> change.value))
+                return reply (session, "error bad parameter change");
+
+            change.parameter = findParameter (*session.processor, id);
+            if (change.parameter == nullptr)
+                return reply (session, "error unknown parameter " + id);
+
+            change.value = juce::jlimit (0.f, 1.f, change.value);
+
+            auto at = std::upper_bound (session.changes.begin(), session.changes.end(), change.time,
+                                        [] (juce::int64 time, const ParameterChange& other) { return time < other.time; });
+            session.changes.insert (at, change);
+        }
+        else
+        {
+            reply (session, "error unknown command " + command);
+        }
+    }
+
+    void finishJobs()
+    {
+        char drain[64];
+        while (read (wake[0], drain, sizeof (drain)) > 0) {}
+
+        std::vector<Session*> finished;
+        {
+            std::lock_guard<std::mutex> guard (lock);
+            finished.swap (done);
+        }
+
+        // commands that arrived while the job ran follow in order
+        for (auto* session : finished)
+        {
+            session->busy = false;
+            runCommands (*session);
+        }
+    }
+
+    void work()
+    {
+        // renders on this thread record into a ring readied before the first job
+        PHYSIGUITAR_TRACE_WARM_UP();
+
+        for (;;)
+        {
+            Session* session;
+
+            {
+                std::unique_lock<std::mutex> guard (lock);
+                wakeWorkers.wait (guard, [this] { return stopping || ! jobs.empty(); });
+
+                if (jobs.empty())
+                    return;
+
+                session = jobs.front();
+                jobs.pop_front();
+            }
+
+            reply (*session, runJob (*session));
+
+            {
+                std::lock_guard<std::mutex> guard (lock);
+                done.push_back (session);
+            }
+
+            char byte = 0;
+            juce::ignoreUnused (write (wake[1], &byte, 1));
+        }
+    }
+
+    std::string runJob (Session& session)
+    {
+        std::istringstream stream (session.job);
+        std::string command;
+        stream >> command;
+
+        if (command == "open")
+        {
+            double sampleRate = 0;
+            int blockSize = 0, slots = 0;
+
+            if (session.processor != nullptr)
+                return "error already open";
+
+            if (! (stream >> sampleRate >> blockSize >> slots)
+                 || sampleRate < 8000.0 || sampleRate > 384000.0
+                 || blockSize < 1 || blockSize > MAX_BLOCK_SIZE || slots < 1 || slots > MAX_SLOTS)
+                return "error bad open";
+
+            session.blockSize = blockSize;
+            session.slots = slots;
+
+            if (! mapShared (session))
+                return std::string ("error shared memory: ") + std::strerror (errno);
+
+            session.processor = pool.acquire (sampleRate, blockSize);
+            clearJob (session);
+
+            return "ok " + session.sharedName + " " + std::to_string (session.sharedBytes);
+        }
+
+        if (session.processor == nullptr)
+            return "error no open session";
+
+        if (command == "reset")
+        {
+            ProcessorPool::restart (*session.processor);
+            clearJob (session);
+            return "ok";
+        }
+
+        int numBlocks = 0;
+        if (! (stream >> numBlocks) || numBlocks < 1 || numBlocks > session.slots)
+            return "error bad render";
+
+        return render (session, numBlocks);
+    }
+
+    ProcessorPool& pool;
+    std::string path;
+    int numWorkers;
+
+    int listener = -1;
+    int wake[2] { -1, -1 };
+    int lastSessionId = 0;
+    std::map<int, std::unique_ptr<Session>> sessions;
+
+    std::mutex lock;
+    std::condition_variable wakeWorkers;
+    std::deque<Session*> jobs;
+    std::vector<Session*> done;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+
+    std::string path = "/tmp/physiguitar.sock";
+    auto numWorkers = (int) juce::jmax (1u, std::thread::hardware_concurrency());
+    int numWarm = numWorkers;
+    double sampleRate = 48000.0;
+    int blockSize = 128;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (std::strcmp (argv[i], "--socket") == 0)
+            path = argv[i + 1];
+        else if (std::strcmp (argv[i], "--workers") == 0)
+            numWorkers = juce::jmax (1, std::atoi (argv[i + 1]));
+        else if (std::strcmp (argv[i], "--warm") == 0)
+            numWarm = juce::jmax (0, std::atoi (argv[i + 1]));
+        else if (std::strcmp (argv[i], "--rate") == 0)
+            sampleRate = std::atof (argv[i + 1]);
+        else if (std::strcmp (argv[i], "--block") == 0)
+            blockSize = juce::jlimit (1, MAX_BLOCK_SIZE, std::atoi (argv[i + 1]));
+    }
+
+    std::signal (SIGPIPE, SIG_IGN);
+    std::signal (SIGINT, stop);
+    std::signal (SIGTERM, stop);
+
+    ProcessorPool pool;
+    pool.warm (numWarm, sampleRate, blockSize);
+
+    {
+        Server server (pool, path, numWorkers);
+        auto error = server.start();
+
+        if (! error.empty())
+        {
+            std::fprintf (stderr, "cannot listen on %s: %s\n", path.c_str(), error.c_str());
+            return 1;
+        }
+
+        std::printf ("listening on %s, %d workers, %d warm processors\n", path.c_str(), numWorkers, numWarm);
+        std::fflush (stdout);
+
+        server.run();
+    }
+
+    PHYSIGUITAR_TRACE_DUMP ("PhysiGuitarRenderDaemon.trace.json");
+
+    return 0;
+}
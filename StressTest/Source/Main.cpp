@@ -0,0 +1,444 @@
+/*
+  ==============================================================================
+
+    Worst-case block time harness for PhysiGuitar.
+
+    Replays adversarial MIDI (note-on storms, retriggers of every voice, dense
+    pitch bend, per-block parameter automation) through the plugin processor
+    and reports the mean, p99.9 and maximum block time against the real-time
+    deadline at 32/64/128 sample buffers. A held chord is played without and
+    with Sympathetic Resonance, the difference is what the open strings cost.
+
+    With --instances it instead renders that many instances at once on a
+    pool of worker threads, the way a host renders tracks in parallel, and
+    fails unless every instance's output is bit-identical to rendering it
+    on its own.
+
+    With --check-sympathetic it renders the scenarios without automation
+    with Sympathetic Resonance off and barely on, and fails unless the
+    voices sound the same both ways.
+
+    With --check-reset it renders every scenario on an instance that was
+    reset after another render, and fails unless the output is bit-identical
+    to rendering it on a new instance.
+
+    Usage: PhysiGuitarStress [--rate 48000] [--blocks 4000] [--instances 32] [--check-sympathetic]
+                             [--check-reset]
+
+  ==============================================================================
+*/
+
+#include <JuceHeader.h>
+
+#include <atomic>
+#include <thread>
+
+#include "Plugin/Source/PluginProcessor.h"
+#include "Plugin/Source/Trace.h"
+
+#define WARMUP_BLOCKS 64
+#define LOWEST_NOTE 40
+#define HIGHEST_NOTE 88
+
+// amount the open strings are checked at and how far that may move the output
+#define SYMPATHETIC_CHECK_AMOUNT 1e-6f
+#define SYMPATHETIC_CHECK_TOLERANCE 1e-5f
+
+struct Scenario
+{
+    const char* name;
+    // fills the MIDI for one block, returns true to also automate parameters
+    std::function<bool (juce::MidiBuffer&, int block, int blockSize, juce::Random&)> fill;
+    // Sympathetic Resonance amount the scenario plays at
+    float sympathetic = 0.f;
+};
+
+static int randomNote (juce::Random& random)
+{
+    return LOWEST_NOTE + random.nextInt (HIGHEST_NOTE - LOWEST_NOTE + 1);
+}
+
+static std::vector<Scenario> createScenarios()
+{
+    std::vector<Scenario> scenarios;
+
+    // 24 overlapping note-ons per block, each one released half a block later
+    scenarios.push_back ({ "note-on storm", [] (juce::MidiBuffer& midi, int, int blockSize, juce::Random& random)
+    {
+        for (int i = 0; i < 24; i++)
+        {
+            int note = randomNote (random);
+            int position = random.nextInt (blockSize);
+
+            midi.addEvent (juce::MidiMessage::noteOn (1, note, (juce::uint8) (1 + random.nextInt (127))), position);
+            midi.addEvent (juce::MidiMessage::noteOff (1, note), juce::jmin (blockSize - 1, position + blockSize / 2));
+        }
+        return false;
+    }});
+
+    // a new six note chord at the start of every block steals every voice
+    scenarios.push_back ({ "retrigger all voices", [] (juce::MidiBuffer& midi, int, int, juce::Random& random)
+    {
+        midi.addEvent (juce::MidiMessage::allNotesOff (1), 0);
+
+        for (int i = 0; i < 6; i++)
+            midi.addEvent (juce::MidiMessage::noteOn (1, randomNote (random), (juce::uint8) 100), 0);
+
+        return false;
+    }});
+
+    // six held notes with a pitch wheel message every four samples
+    scenarios.push_back ({ "dense pitch bend", [] (juce::MidiBuffer& midi, int block, int blockSize, juce::Random& random)
+    {
+        if (block % 256 == 0)
+            for (int i = 0; i < 6; i++)
+                midi.addEvent (juce::MidiMessage::noteOn (1, LOWEST_NOTE + i * 5, (juce::uint8) 100), 0);
+
+        for (int position = 0; position < blockSize; position += 4)
+            midi.addEvent (juce::MidiMessage::pitchWheel (1, random.nextInt (16384)), position);
+
+        return false;
+    }});
+
+    // six held notes while every parameter changes on every block
+    scenarios.push_back ({ "parameter automation", [] (juce::MidiBuffer& midi, int block, int, juce::Random&)
+    {
+        if (block % 256 == 0)
+            for (int i = 0; i < 6; i++)
+                midi.addEvent (juce::MidiMessage::noteOn (1, LOWEST_NOTE + i * 5, (juce::uint8) 100), 0);
+
+        return true;
+    }});
+
+    // all of the above in the same blocks
+    scenarios.push_back ({ "combined", [scenarios] (juce::MidiBuffer& midi, int block, int blockSize, juce::Random& random)
+    {
+        bool automate = false;
+        for (auto& scenario : scenarios)
+            automate |= scenario.fill (midi, block, blockSize, random);
+        return automate;
+    }});
+
+    // six held notes, without and with the open strings ringing along, the difference is what they cost
+    auto chord = [] (juce::MidiBuffer& midi, int block, int, juce::Random&)
+    {
+        if (block % 256 == 0)
+            for (int i = 0; i < 6; i++)
+                midi.addEvent (juce::MidiMessage::noteOn (1, LOWEST_NOTE + i * 5, (juce::uint8) 100), 0);
+
+        return false;
+    };
+
+    scenarios.push_back ({ "held chord", chord });
+    scenarios.push_back ({ "sympathetic chord", chord, 1.f });
+
+    return scenarios;
+}
+
+static void automateParameters (juce::AudioProcessor& processor, int block, juce::Random& random)
+{
+    for (auto* parameter : processor.getParameters())
+    {
+        // toggling quality or bass or switching the engine resets the strings, so only do it now and then
+        if (dynamic_cast<juce::AudioParameterBool*> (parameter) != nullptr)
+        {
+            if (block % 32 == 0)
+                parameter->setValueNotifyingHost (parameter->getValue() < 0.5f ? 1.f : 0.f);
+        }
+        else if (auto* choice = dynamic_cast<juce::AudioParameterChoice*> (parameter))
+        {
+            if (block % 32 == 0)
+                parameter->setValueNotifyingHost (choice->convertTo0to1 ((float) ((choice->getIndex() + 1) % choice->choices.size())));
+        }
+        else
+            parameter->setValueNotifyingHost (random.nextFloat());
+    }
+}
+
+static void setParameter (juce::AudioProcessor& processor, const char* id, float value)
+{
+    for (auto* parameter : processor.getParameters())
+        if (auto* withID = dynamic_cast<juce::AudioProcessorParameterWithID*> (parameter))
+            if (withID->paramID == id)
+                parameter->setValueNotifyingHost (value);
+}
+
+static double percentile (std::vector<double> times, double fraction)
+{
+    std::sort (times.begin(), times.end());
+    auto index = (size_t) std::ceil (fraction * (double) times.size());
+    return times[juce::jlimit ((size_t) 0, times.size() - 1, index == 0 ? 0 : index - 1)];
+}
+
+static void runScenario (const Scenario& scenario, double sampleRate, int blockSize, int numBlocks)
+{
+    PhysiGuitarAudioProcessor processor;
+    processor.setRateAndBufferSizeDetails (sampleRate, blockSize);
+    processor.prepareToPlay (sampleRate, blockSize);
+    setParameter (processor, "sympathetic", scenario.sympathetic);
+
+    juce::AudioBuffer<float> buffer (2, blockSize);
+    juce::MidiBuffer midi;
+    juce::Random random (blockSize);
+
+    std::vector<double> times;
+    times.reserve ((size_t) numBlocks);
+
+    auto ticksToMicroseconds = 1.0e6 / (double) juce::Time::getHighResolutionTicksPerSecond();
+    double deadline = 1.0e6 * blockSize / sampleRate;
+    int overruns = 0;
+
+    for (int block = 0; block < WARMUP_BLOCKS + numBlocks; block++)
+    {
+        midi.clear();
+        bool automate = scenario.fill (midi, block, blockSize, random);
+        buffer.clear();
+
+        // parameter changes land between blocks, as they would from a host, so they are not timed
+        if (automate)
+            automateParameters (processor, block, random);
+
+        auto start = juce::Time::getHighResolutionTicks();
+        processor.processBlock (buffer, midi);
+        auto elapsed = (double) (juce::Time::getHighResolutionTicks() - start) * ticksToMicroseconds;
+
+        if (block < WARMUP_BLOCKS)
+            continue;
+
+        times.push_back (elapsed);
+        if (elapsed > deadline)
+            overruns++;
+    }
+
+    processor.releaseResources();
+
+    double mean = 0;
+    for (auto time : times)
+        mean += time;
+    mean /= (double) times.size();
+
+    double worst = *std::max_element (times.begin(), times.end());
+
+    std::printf ("%-22s %5d %10.1f %10.2f %10.2f %10.2f %8.1f%% %8d\n",
+                 scenario.name, blockSize, deadline, mean, percentile (times, 0.999), worst,
+                 100.0 * worst / deadline, overruns);
+}
+
+// renders a scenario on a prepared processor, seeded so every index plays something different
+static std::vector<float> render (PhysiGuitarAudioProcessor& processor, const Scenario& scenario, int index, int blockSize, int numBlocks)
+{
+    setParameter (processor, "sympathetic", scenario.sympathetic);
+
+    juce::AudioBuffer<float> buffer (2, blockSize);
+    juce::MidiBuffer midi;
+    juce::Random random (index + 1);
+
+    std::vector<float> output;
+    output.reserve ((size_t) (numBlocks * blockSize));
+
+    for (int block = 0; block < numBlocks; block++)
+    {
+        midi.clear();
+        bool automate = scenario.fill (midi, block, blockSize, random);
+        buffer.clear();
+
+        if (automate)
+            automateParameters (processor, block, random);
+        processor.processBlock (buffer, midi);
+
+        auto* samples = buffer.getReadPointer (0);
+        output.insert (output.end(), samples, samples + blockSize);
+    }
+
+    return output;
+}
+
+// renders one instance through a scenario on a processor of its own
+static std::vector<float> renderInstance (const Scenario& scenario, int index, double sampleRate, int blockSize, int numBlocks)
+{
+    PhysiGuitarAudioProcessor processor;
+    processor.setRateAndBufferSizeDetails (sampleRate, blockSize);
+    processor.prepareToPlay (sampleRate, blockSize);
+
+    auto output = render (processor, scenario, index, blockSize, numBlocks);
+
+    processor.releaseResources();
+    return output;
+}
+
+static int runConcurrency (int numInstances, double sampleRate, int numBlocks)
+{
+    const int blockSize = 128;
+    auto scenarios = createScenarios();
+    auto scenario = *std::find_if (scenarios.begin(), scenarios.end(), [] (const Scenario& s) { return std::strcmp (s.name, "combined") == 0; });
+    auto numThreads = (int) juce::jmax (1u, std::thread::hardware_concurrency());
+
+    auto ticksToMilliseconds = 1.0e3 / (double) juce::Time::getHighResolutionTicksPerSecond();
+
+    std::vector<std::vector<float>> reference ((size_t) numInstances);
+    auto start = juce::Time::getHighResolutionTicks();
+    for (int i = 0; i < numInstances; i++)
+        reference[(size_t) i] = renderInstance (scenario, i, sampleRate, blockSize, numBlocks);
+    auto serial = (double) (juce::Time::getHighResolutionTicks() - start) * ticksToMilliseconds;
+
+    std::vector<std::vector<float>> parallel ((size_t) numInstances);
+    std::atomic<int> next { 0 };
+    std::vector<std::thread> workers;
+
+    start = juce::Time::getHighResolutionTicks();
+    for (int t = 0; t < numThreads; t++)
+    {
+        workers.emplace_back ([&]
+        {
+            for (int i = next++; i < numInstances; i = next++)
+                parallel[(size_t) i] = renderInstance (scenario, i, sampleRate, blockSize, numBlocks);
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    auto concurrent = (double) (juce::Time::getHighResolutionTicks() - start) * ticksToMilliseconds;
+
+    int mismatches = 0;
+    for (int i = 0; i < numInstances; i++)
+        if (parallel[(size_t) i] != reference[(size_t) i])
+            mismatches++;
+
+    std::printf ("%d instances, %d threads: serial %.1f ms, parallel %.1f ms, speedup %.2fx\n",
+                 numInstances, numThreads, serial, concurrent, serial / concurrent);
+    std::printf ("%d of %d instances differ from their serial render\n", mismatches, numInstances);
+
+    return mismatches == 0 ? 0 : 1;
+}
+
+// the open strings render between sub-blocks, which must not move the voices' events
+static int checkSympathetic (double sampleRate, int numBlocks)
+{
+    int failures = 0;
+
+    for (auto& scenario : createScenarios())
+    {
+        juce::MidiBuffer midi;
+        juce::Random random;
+        if (scenario.fill (midi, 0, 128, random) || scenario.sympathetic > 0.f)
+            continue;
+
+        auto barely = scenario;
+        barely.sympathetic = SYMPATHETIC_CHECK_AMOUNT;
+
+        for (int blockSize : { 32, 100, 128 })
+        {
+            auto off = renderInstance (scenario, 0, sampleRate, blockSize, numBlocks);
+            auto on = renderInstance (barely, 0, sampleRate, blockSize, numBlocks);
+
+            float difference = 0.f;
+            bool failed = false;
+
+            for (size_t i = 0; i < off.size(); i++)
+            {
+                auto sample = std::abs (on[i] - off[i]);
+                difference = juce::jmax (difference, sample);
+                // written so that a NaN fails too
+                failed |= ! (sample <= SYMPATHETIC_CHECK_TOLERANCE);
+            }
+
+            failures += failed ? 1 : 0;
+
+            std::printf ("%-22s %5d  max difference %g%s\n", scenario.name, blockSize, difference, failed ? "  FAILED" : "");
+        }
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+// a reused instance, as the render daemon keeps them, must sound like a new one after a reset,
+// also when the next render starts on the notes the previous one played
+static int checkReset (double sampleRate, int numBlocks)
+{
+    const int blockSize = 128;
+    int failures = 0;
+
+    for (auto& scenario : createScenarios())
+    {
+        auto fresh = renderInstance (scenario, 0, sampleRate, blockSize, numBlocks);
+
+        for (int previous : { 0, 1 })
+        {
+            PhysiGuitarAudioProcessor processor;
+            processor.setRateAndBufferSizeDetails (sampleRate, blockSize);
+            processor.prepareToPlay (sampleRate, blockSize);
+            render (processor, scenario, previous, blockSize, numBlocks);
+
+            for (auto* parameter : processor.getParameters())
+                parameter->setValueNotifyingHost (parameter->getDefaultValue());
+            processor.reset();
+
+            auto reused = render (processor, scenario, 0, blockSize, numBlocks);
+            processor.releaseResources();
+
+            size_t first = 0;
+            while (first < fresh.size() && fresh[first] == reused[first])
+                first++;
+
+            bool failed = first < fresh.size();
+            failures += failed ? 1 : 0;
+
+            std::printf ("%-22s after %s  ", scenario.name, previous == 0 ? "the same render " : "another render  ");
+            if (failed)
+                std::printf ("differs from sample %d  FAILED\n", (int) first);
+            else
+                std::printf ("identical\n");
+        }
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+//==============================================================================
+int main (int argc, char* argv[])
+{
+    juce::ScopedJuceInitialiser_GUI juceInitialiser;
+
+    double sampleRate = 48000.0;
+    int numBlocks = 4000;
+    int numInstances = 0;
+    bool sympatheticCheck = false;
+    bool resetCheck = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp (argv[i], "--check-sympathetic") == 0)
+            sympatheticCheck = true;
+        else if (std::strcmp (argv[i], "--check-reset") == 0)
+            resetCheck = true;
+        else if (i + 1 >= argc)
+            break;
+        else if (std::strcmp (argv[i], "--rate") == 0)
+            sampleRate = std::atof (argv[++i]);
+        else if (std::strcmp (argv[i], "--blocks") == 0)
+            numBlocks = juce::jmax (1, std::atoi (argv[++i]));
+        else if (std::strcmp (argv[i], "--instances") == 0)
+            numInstances = juce::jmax (1, std::atoi (argv[++i]));
+    }
+
+    if (sympatheticCheck)
+        return checkSympathetic (sampleRate, numBlocks);
+
+    if (resetCheck)
+        return checkReset (sampleRate, numBlocks);
+
+    if (numInstances > 0)
+        return runConcurrency (numInstances, sampleRate, numBlocks);
+
+    std::printf ("%-22s %5s %10s %10s %10s %10s %9s %8s\n",
+                 "scenario", "block", "deadline", "mean", "p99.9", "max", "max/ddl", "overruns");
+    std::printf ("%-22s %5s %10s %10s %10s %10s %9s %8s\n",
+                 "", "", "(us)", "(us)", "(us)", "(us)", "", "");
+
+    for (auto& scenario : createScenarios())
+        for (int blockSize : { 32, 64, 128 })
+            runScenario (scenario, sampleRate, blockSize, numBlocks);
+
+    PHYSIGUITAR_TRACE_DUMP ("PhysiGuitarStress.trace.json");
+
+    return 0;
+}